@@ -0,0 +1,222 @@
+#include "Animation.hpp"
+
+#include "JointNode.hpp"
+#include "cs488-framework/MathUtils.hpp"
+
+#include <glm/gtx/transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace glm;
+
+// T * Rz * Ry * Rx * S built directly rather than through four matrix products.
+static mat4 composeTRS(const vec3 &t, const vec3 &degrees, const vec3 &s) {
+  const vec3 radians(degreesToRadians(degrees.x), degreesToRadians(degrees.y), degreesToRadians(degrees.z));
+  float cx = std::cos(radians.x), sx = std::sin(radians.x);
+  float cy = std::cos(radians.y), sy = std::sin(radians.y);
+  float cz = std::cos(radians.z), sz = std::sin(radians.z);
+
+  mat4 m;
+  m[0] = vec4(cy * cz, cy * sz, -sy, 0.0f) * s.x;
+  m[1] = vec4(cz * sy * sx - sz * cx, sz * sy * sx + cz * cx, cy * sx, 0.0f) * s.y;
+  m[2] = vec4(cz * sy * cx + sz * sx, sz * sy * cx - cz * sx, cy * cx, 0.0f) * s.z;
+  m[3] = vec4(t, 1.0f);
+  return m;
+}
+
+//---------------------------------------------------------------------------------------
+void AnimationClip::addKey(SceneNode *target, AnimChannel channel, float time, float value) {
+  Track *track = nullptr;
+  for (Track &t : tracks) {
+    if (t.target == target && t.channel == channel) {
+      track = &t;
+      break;
+    }
+  }
+  if (!track) {
+    tracks.push_back(Track{target, channel, vector<Keyframe>()});
+    track = &tracks.back();
+  }
+  track->keys.push_back(Keyframe{time, value});
+}
+
+//---------------------------------------------------------------------------------------
+int Animator::bindTarget(SceneNode *target) {
+  for (size_t i = 0; i < m_targets.size(); i++) {
+    if (m_targets[i] == target) return i;
+  }
+
+  m_targets.push_back(target);
+  m_restTransforms.push_back(target->trans);
+  m_spinAxes.push_back(vec3(0.0f, 0.0f, 1.0f));
+  m_dirty.push_back(1);
+  m_channels.resize(m_channels.size() + NUM_CHANNELS, 0.0f);
+  float *channels = &m_channels[m_channels.size() - NUM_CHANNELS];
+  channels[(int)AnimChannel::ScaleX] = 1.0f;
+  channels[(int)AnimChannel::ScaleY] = 1.0f;
+  channels[(int)AnimChannel::ScaleZ] = 1.0f;
+
+  if (target->m_nodeType == NodeType::JointNode) {
+    const JointNode *joint = static_cast<const JointNode *>(target);
+    channels[(int)AnimChannel::JointX] = joint->m_joint_x.init;
+    channels[(int)AnimChannel::JointY] = joint->m_joint_y.init;
+  }
+  return m_targets.size() - 1;
+}
+
+//---------------------------------------------------------------------------------------
+void Animator::play(const AnimationClip &clip, float speed) {
+  for (const AnimationClip::Track &track : clip.tracks) {
+    if (track.keys.empty()) continue;
+
+    int slot = bindTarget(track.target);
+    m_trackChannel.push_back(slot * NUM_CHANNELS + (int)track.channel);
+    m_keyBegin.push_back(m_keyTimes.size());
+    m_keyCount.push_back(track.keys.size());
+    m_cursor.push_back(0);
+    m_trackTime.push_back(0.0f);
+    m_trackSpeed.push_back(speed);
+    m_trackDuration.push_back(track.keys.back().time);
+    m_trackLoop.push_back(clip.loop);
+
+    for (const Keyframe &key : track.keys) {
+      m_keyTimes.push_back(key.time);
+      m_keyValues.push_back(key.value);
+    }
+  }
+
+  size_t n = m_trackTime.size();
+  m_from.resize(n);
+  m_to.resize(n);
+  m_alpha.resize(n);
+  m_result.resize(n);
+}
+
+//---------------------------------------------------------------------------------------
+void Animator::stopAll() {
+  m_trackChannel.clear();
+  m_keyBegin.clear();
+  m_keyCount.clear();
+  m_cursor.clear();
+  m_trackTime.clear();
+  m_trackSpeed.clear();
+  m_trackDuration.clear();
+  m_trackLoop.clear();
+  m_keyTimes.clear();
+  m_keyValues.clear();
+  m_from.clear();
+  m_to.clear();
+  m_alpha.clear();
+  m_result.clear();
+}
+
+//---------------------------------------------------------------------------------------
+void Animator::clear() {
+  stopAll();
+  m_targets.clear();
+  m_restTransforms.clear();
+  m_spinAxes.clear();
+  m_channels.clear();
+  m_dirty.clear();
+}
+
+//---------------------------------------------------------------------------------------
+void Animator::setChannel(SceneNode *target, AnimChannel channel, float value) {
+  int slot = bindTarget(target);
+  m_channels[slot * NUM_CHANNELS + (int)channel] = value;
+  m_dirty[slot] = 1;
+}
+
+void Animator::setSpinAxis(SceneNode *target, const vec3 &axis) {
+  int slot = bindTarget(target);
+  m_spinAxes[slot] = axis;
+  m_dirty[slot] = 1;
+}
+
+//---------------------------------------------------------------------------------------
+void Animator::update(float dt) {
+  const size_t n = m_trackTime.size();
+
+  // Advance the local time of every track.
+  for (size_t i = 0; i < n; i++) {
+    float duration = m_trackDuration[i];
+    float t = m_trackTime[i] + dt * m_trackSpeed[i];
+    if (duration <= 0.0f) {
+      t = 0.0f;
+    } else if (m_trackLoop[i]) {
+      t = std::fmod(t, duration);
+      if (t < 0.0f) t += duration;
+    } else {
+      t = std::min(std::max(t, 0.0f), duration);
+    }
+    m_trackTime[i] = t;
+  }
+
+  // Find the surrounding keys. Playback is coherent so the cursor from the
+  // previous update is almost always the right segment already.
+  for (size_t i = 0; i < n; i++) {
+    const float *times = &m_keyTimes[m_keyBegin[i]];
+    const float *values = &m_keyValues[m_keyBegin[i]];
+    unsigned last = m_keyCount[i] - 1;
+    unsigned k = std::min(m_cursor[i], last);
+    float t = m_trackTime[i];
+
+    if (times[k] > t) k = 0;
+    while (k < last && times[k + 1] <= t) k++;
+    m_cursor[i] = k;
+
+    unsigned k1 = std::min(k + 1, last);
+    float span = times[k1] - times[k];
+    m_from[i] = values[k];
+    m_to[i] = values[k1];
+    m_alpha[i] = span > 0.0f ? std::min((t - times[k]) / span, 1.0f) : 0.0f;
+  }
+
+  // Interpolate every track at once.
+  const float *from = m_from.data();
+  const float *to = m_to.data();
+  const float *alpha = m_alpha.data();
+  float *result = m_result.data();
+  for (size_t i = 0; i < n; i++) {
+    result[i] = from[i] + (to[i] - from[i]) * alpha[i];
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    m_channels[m_trackChannel[i]] = result[i];
+    m_dirty[m_trackChannel[i] / NUM_CHANNELS] = 1;
+  }
+
+  for (size_t slot = 0; slot < m_targets.size(); slot++) {
+    if (m_dirty[slot]) writeTarget(slot);
+  }
+}
+
+//---------------------------------------------------------------------------------------
+void Animator::writeTarget(int slot) {
+  const float *c = &m_channels[slot * NUM_CHANNELS];
+  SceneNode *target = m_targets[slot];
+
+  vec3 translation(c[(int)AnimChannel::TranslateX], c[(int)AnimChannel::TranslateY], c[(int)AnimChannel::TranslateZ]);
+  vec3 rotation(c[(int)AnimChannel::RotateX], c[(int)AnimChannel::RotateY], c[(int)AnimChannel::RotateZ]);
+  vec3 scale(c[(int)AnimChannel::ScaleX], c[(int)AnimChannel::ScaleY], c[(int)AnimChannel::ScaleZ]);
+
+  if (target->m_nodeType == NodeType::JointNode) {
+    const JointNode *joint = static_cast<const JointNode *>(target);
+    rotation.x += glm::clamp((double)c[(int)AnimChannel::JointX], joint->m_joint_x.min, joint->m_joint_x.max);
+    rotation.y += glm::clamp((double)c[(int)AnimChannel::JointY], joint->m_joint_y.min, joint->m_joint_y.max);
+  }
+
+  mat4 trs = composeTRS(translation, rotation, scale);
+  float spin = c[(int)AnimChannel::Spin];
+  if (spin != 0.0f) {
+    // Between T and R: trs[3] holds only the translation.
+    vec4 t = trs[3];
+    trs[3] = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    trs = glm::rotate(degreesToRadians(spin), m_spinAxes[slot]) * trs;
+    trs[3] = t;
+  }
+  target->set_transform(trs * m_restTransforms[slot]);
+  m_dirty[slot] = 0;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "SceneNode.hpp"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+// Animatable scalar channels of a node. Translations are in scene units,
+// rotations and joint angles in degrees. Spin turns about the node's spin
+// axis (see Animator::setSpinAxis).
+enum class AnimChannel {
+  TranslateX, TranslateY, TranslateZ,
+  RotateX, RotateY, RotateZ,
+  ScaleX, ScaleY, ScaleZ,
+  JointX, JointY,
+  Spin,
+  COUNT
+};
+
+struct Keyframe {
+  float time;
+  float value;
+};
+
+// A set of keyframe tracks, one per (node, channel). Keys must be added in
+// increasing time order. Times are in whatever unit Animator::update is
+// advanced by (the game advances one unit per frame).
+struct AnimationClip {
+  struct Track {
+    SceneNode *target;
+    AnimChannel channel;
+    std::vector<Keyframe> keys;
+  };
+
+  AnimationClip() : loop(true) {}
+
+  void addKey(SceneNode *target, AnimChannel channel, float time, float value);
+
+  std::vector<Track> tracks;
+  bool loop;
+};
+
+// Plays clips on the scene graph. All active tracks are evaluated together each
+// update from flat arrays, and every animated node's transform is rebuilt once
+// from its channels:
+//
+//   trans = T * Spin * Rz * Ry * Rx * S * rest
+//
+// where rest is the node's transform when it was first animated. Joint angles
+// are clamped to the JointNode's range and added to the x/y rotation.
+class Animator {
+public:
+  void play(const AnimationClip &clip, float speed = 1.0f);
+  void stopAll();
+
+  // Stop everything and forget all target nodes (e.g. before they are freed).
+  void clear();
+
+  // Hold a channel at a fixed value (e.g. driven by input) until changed.
+  void setChannel(SceneNode *target, AnimChannel channel, float value);
+
+  // Unit axis of the target's Spin channel, z by default.
+  void setSpinAxis(SceneNode *target, const glm::vec3 &axis);
+
+  // Advance every track by dt and write the results into the scene.
+  void update(float dt);
+
+  size_t numTracks() const { return m_trackTime.size(); }
+  size_t numTargets() const { return m_targets.size(); }
+
+private:
+  static const int NUM_CHANNELS = (int)AnimChannel::COUNT;
+
+  int bindTarget(SceneNode *target);
+  void writeTarget(int slot);
+
+  // Per target node.
+  std::vector<SceneNode *> m_targets;
+  std::vector<glm::mat4> m_restTransforms;
+  std::vector<glm::vec3> m_spinAxes;
+  std::vector<float> m_channels; // NUM_CHANNELS per target
+  std::vector<char> m_dirty;
+
+  // Per track, structure of arrays.
+  std::vector<int> m_trackChannel; // index into m_channels
+  std::vector<unsigned> m_keyBegin;
+  std::vector<unsigned> m_keyCount;
+  std::vector<unsigned> m_cursor;
+  std::vector<float> m_trackTime;
+  std::vector<float> m_trackSpeed;
+  std::vector<float> m_trackDuration;
+  std::vector<char> m_trackLoop;
+
+  // Keys of every track, back to back.
+  std::vector<float> m_keyTimes;
+  std::vector<float> m_keyValues;
+
+  // Per track interpolation inputs and result.
+  std::vector<float> m_from, m_to, m_alpha, m_result;
+};
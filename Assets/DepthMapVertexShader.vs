@@ -1,10 +1,14 @@
 #version 330 core
 layout (location = 0) in vec3 position;
 
-uniform mat4 LightSpaceMatrix;
-uniform mat4 Model;
+// Per-instance data, streamed through Project::m_drawRing
+in mat4 Model;
+in int meshIndex;
 
 void main()
 {
-    gl_Position = LightSpaceMatrix * Model * vec4(position, 1.0);
+    // Expand positions stored as fractions of the mesh bounds
+    MeshData mesh = meshes[meshIndex];
+    vec3 modelPos = position * mesh.positionScale.xyz + mesh.positionBias.xyz;
+    gl_Position = LightSpaceMatrix * Model * vec4(modelPos, 1.0);
 }  
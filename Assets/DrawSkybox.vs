@@ -7,11 +7,9 @@ out VsOutFsIn {
 } vs_out;
 
 uniform mat4 model;
-uniform mat4 projection;
-uniform mat4 view;
 
 void main()
 {
     vs_out.TexCoords = aPos;
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
+    gl_Position = Perspective * View * model * vec4(aPos, 1.0);
 }  
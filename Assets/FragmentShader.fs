@@ -4,6 +4,14 @@ uniform sampler2D textureSampler;
 uniform sampler2D normalMap;
 uniform sampler2D shadowMap;
 
+// Clustered point lights, see ClusteredLights.hpp
+const int CLUSTERS_X = 16;
+const int CLUSTERS_Y = 9;
+const int CLUSTERS_Z = 24;
+uniform samplerBuffer lightData;      // position and radius, then colour
+uniform usamplerBuffer clusterData;   // first index and count
+uniform usamplerBuffer lightIndices;
+
 struct LightSource {
     vec3 position;
     vec3 rgbIntensity;
@@ -18,23 +26,31 @@ in VsOutFsIn {
   vec3 TangentViewPos;
   vec3 TangentFragPos;
   vec3 correctNormal;
+
+  vec3 worldPos;
+  mat3 tangentToWorld;
 } fs_in;
+flat in int fragMaterialIndex;
 
 
 layout(location=0) out vec4 fragColour;
+// Only written to when weightedPass is set, see Project::renderWeightedTransparentNodes
+layout(location=1) out vec4 fragWeight;
+
+// Transparent fragments go to the weighted blended OIT targets
+uniform int weightedPass;
 
+// Every material of the scene, see MaterialData in DrawRingBuffer.hpp
 struct Material {
     vec3 kd;
-    vec3 ks;
     float shininess;
+    vec3 ks;
     float transparency;
 };
-uniform Material material;
-
-// Ambient light intensity for each RGB component.
-uniform vec3 ambientIntensity;
-uniform int showShadows;
-uniform int showTextures;
+const int MAX_MATERIALS = 256;
+layout(std140) uniform Materials {
+  Material materials[MAX_MATERIALS];
+};
 
 vec2 poissondist[4] = vec2[](
   vec2( -0.94201624, -0.39906216 ),
@@ -43,7 +59,41 @@ vec2 poissondist[4] = vec2[](
   vec2( 0.34495938, 0.29387760 )
 );
 
+// Diffuse and specular from the point lights in this fragment's cluster.
+vec3 pointLighting(Material material, vec3 color, vec3 tangentNormal) {
+  vec3 normal = normalize(fs_in.tangentToWorld * tangentNormal);
+  vec3 viewDir = normalize(viewPos - fs_in.worldPos);
+
+  ivec3 cluster = ivec3(gl_FragCoord.xy * clusterTileScale,
+      floor(log(1.0 / gl_FragCoord.w) * clusterZScale + clusterZBias));
+  cluster = clamp(cluster, ivec3(0), ivec3(CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z) - 1);
+  uvec2 range = texelFetch(clusterData, (cluster.z * CLUSTERS_Y + cluster.y) * CLUSTERS_X + cluster.x).rg;
+
+  vec3 result = vec3(0);
+  for (uint i = 0u; i < range.y; i++) {
+    int light = int(texelFetch(lightIndices, int(range.x + i)).r);
+    vec4 positionRadius = texelFetch(lightData, 2 * light);
+    vec3 colour = texelFetch(lightData, 2 * light + 1).rgb;
+
+    vec3 toLight = positionRadius.xyz - fs_in.worldPos;
+    float dist2 = dot(toLight, toLight);
+    float r2 = positionRadius.w * positionRadius.w;
+    if (dist2 >= r2) continue;
+    // Smooth falloff to zero at the radius
+    float falloff = 1.0 - dist2 / r2;
+    falloff *= falloff;
+
+    vec3 lightDir = toLight * inversesqrt(max(dist2, 1e-8));
+    vec3 halfwayDir = normalize(lightDir + viewDir);
+    vec3 diffuse = max(dot(normal, lightDir), 0.0) * material.kd * color;
+    vec3 specular = material.ks * pow(max(dot(normal, halfwayDir), 0.0), material.shininess);
+    result += falloff * colour * (diffuse + specular);
+  }
+  return result;
+}
+
 void main() {
+  Material material = materials[fragMaterialIndex];
 
   vec3 normal;
   normal = texture(normalMap, fs_in.texCoords).rgb;
@@ -89,5 +139,18 @@ void main() {
 
   shadow = shadow * showShadows;
 
-  fragColour = vec4(ambient + (1-shadow)*(diffuse + specular),material.transparency);
+  vec3 lit = ambient + (1-shadow)*(diffuse + specular);
+  if (showPointLights != 0) lit += pointLighting(material, color, normal);
+  float alpha = (showTransparent != 0) ? material.transparency : 1.0;
+  if (weightedPass != 0) {
+    // Nearer fragments weigh more (McGuire and Bavoil's view depth weight);
+    // 1/gl_FragCoord.w is the view space distance along -z.
+    float z = 1.0 / gl_FragCoord.w;
+    float w = alpha * clamp(10.0 / (1e-5 + pow(z / 5.0, 2.0) + pow(z / 200.0, 6.0)), 1e-2, 3e3);
+    fragColour = vec4(lit * alpha * w, alpha);
+    fragWeight = vec4(alpha * w);
+  } else {
+    fragColour = vec4(lit, alpha);
+    fragWeight = vec4(0);
+  }
 }
@@ -0,0 +1,18 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// Weighted blended transparency targets, see Project::renderWeightedTransparentNodes
+uniform sampler2D accumTexture;
+uniform sampler2D weightTexture;
+
+void main()
+{
+  vec4 accum = texture(accumTexture, TexCoords);
+  float revealage = accum.a;
+  if (revealage >= 1.0) discard;
+
+  float weight = texture(weightTexture, TexCoords).r;
+  FragColor = vec4(accum.rgb / max(weight, 1e-5), 1.0 - revealage);
+}
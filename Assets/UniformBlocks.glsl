@@ -0,0 +1,30 @@
+// Uniform blocks shared with the C++ side. Project::createShader inserts this
+// file after the #version line of every shader, so it has no #version itself.
+
+// Per-frame constants, see FrameUniforms.hpp
+layout(std140) uniform FrameUniforms {
+  mat4 Perspective;
+  mat4 View;
+  mat4 LightSpaceMatrix;
+  vec3 viewPos;
+  vec3 lightPosition;
+  vec3 lightIntensity;
+  vec3 ambientIntensity;
+  int showShadows;
+  int showTextures;
+  int showTransparent;
+  int showPointLights;
+  vec2 clusterTileScale;
+  float clusterZScale;
+  float clusterZBias;
+};
+
+// Per-mesh position expansion, see MeshData in DrawRingBuffer.hpp
+struct MeshData {
+  vec4 positionScale;
+  vec4 positionBias;
+};
+const int MAX_MESHES = 256;
+layout(std140) uniform Meshes {
+  MeshData meshes[MAX_MESHES];
+};
@@ -1,6 +1,8 @@
 #version 330
 
-// Model-Space coordinates
+// Model-Space coordinates. Positions may be stored as fractions of the mesh
+// bounds and are expanded with meshes[meshIndex]; normals and tangents arrive
+// as 10:10:10:2 and UVs as half floats, which GL expands for us.
 in vec3 position;
 in vec3 normal;
 in vec2 vertexUV;
@@ -10,13 +12,12 @@ struct LightSource {
     vec3 position;
     vec3 rgbIntensity;
 };
-uniform LightSource light;
-uniform vec3 viewPos;
 
-uniform mat4 LightSpaceMatrix;
-uniform mat4 Model;
-uniform mat4 View;
-uniform mat4 Perspective;
+// Per-instance data, streamed through Project::m_drawRing
+in mat4 Model;
+in mat3 NormalMatrix; // computed once per object, see normalMatrix()
+in int materialIndex;
+in int meshIndex;
 
 out VsOutFsIn {
   vec2 texCoords;
@@ -28,17 +29,23 @@ out VsOutFsIn {
   vec3 TangentFragPos;
 
   vec3 correctNormal;
+
+  // For the point lights, which are shaded in world space
+  vec3 worldPos;
+  mat3 tangentToWorld;
 } vs_out;
+flat out int fragMaterialIndex;
 
 void main() {
-	vec4 pos4 = vec4(position, 1.0);
+	MeshData mesh = meshes[meshIndex];
+	vec4 pos4 = vec4(position * mesh.positionScale.xyz + mesh.positionBias.xyz, 1.0);
 
   vs_out.texCoords = vertexUV;
+  fragMaterialIndex = materialIndex;
   vs_out.fragPosLightSpace = LightSpaceMatrix * Model * pos4;
 
-	vs_out.light = light;
+	vs_out.light = LightSource(lightPosition, lightIntensity);
 
-  mat3 NormalMatrix = transpose(inverse(mat3(Model)));
   vec3 T = normalize(NormalMatrix * aTangent);
   vec3 N = normalize(NormalMatrix * normal);
 
@@ -46,8 +53,10 @@ void main() {
   vec3 B = cross(N,T);
 
   mat3 TBN = transpose(mat3(T,B,N));
+  vs_out.tangentToWorld = mat3(T,B,N);
+  vs_out.worldPos = vec3(Model * pos4);
 
-  vs_out.TangentLightPos =TBN* light.position;
+  vs_out.TangentLightPos =TBN* lightPosition;
   vs_out.TangentViewPos = TBN * viewPos;
   vs_out.TangentFragPos = TBN*vec3(Model * pos4);
   
@@ -8,6 +8,8 @@ cannonShift:translate(0,-6,-0.5)
 
 cannon = gr.node('~cannon')
 cannonShift:add_child(cannon)
+-- aimed every frame, keep it out of the cached shadow map
+cannon:set_layer('dynamic')
 
 cannonShaft = gr.mesh('cylinder', 'cannonShaft')
 cannonShaft:scale(0.1, 1,0.1);
@@ -24,6 +26,7 @@ marbleBG:scale(11.1,13,2)
 marbleBG:translate(0,0,1)
 marbleBG:set_material(gr.material({0.6, 0.6, 0.6}, {0.3, 0.3, 0.4}, 20))
 marbleBG:set_texture('~perlin', '')
+marbleBG:set_layer('shadow', false) -- only receives shadows
 rootNode:add_child(marbleBG)
 
 wall = gr.node('cylinder')
@@ -0,0 +1,88 @@
+#include "Bounds.hpp"
+
+using namespace glm;
+
+void Aabb::expand(const vec3 &p) {
+  min = glm::min(min, p);
+  max = glm::max(max, p);
+}
+
+void Aabb::expand(const Aabb &box) {
+  if (box.empty()) return;
+  min = glm::min(min, box.min);
+  max = glm::max(max, box.max);
+}
+
+Aabb transformAabb(const Aabb &box, const mat4 &m) {
+  if (box.empty()) return box;
+
+  // Transform the center, and take the extent along each world axis as the sum
+  // of the absolute contributions of the box's local axes.
+  vec3 c = vec3(m * vec4(box.center(), 1.0f));
+  vec3 e = box.extent();
+  vec3 we(0.0f);
+  for (int i = 0; i < 3; i++) {
+    we += glm::abs(vec3(m[i])) * e[i];
+  }
+  return Aabb(c - we, c + we);
+}
+
+Frustum::Frustum(const mat4 &vp) {
+  // Gribb & Hartmann: the planes are sums/differences of the rows of vp.
+  vec4 rows[4];
+  for (int i = 0; i < 4; i++) {
+    rows[i] = vec4(vp[0][i], vp[1][i], vp[2][i], vp[3][i]);
+  }
+  for (int i = 0; i < 3; i++) {
+    planes[i * 2] = rows[3] + rows[i];
+    planes[i * 2 + 1] = rows[3] - rows[i];
+  }
+}
+
+Frustum::Result Frustum::test(const Aabb &box) const {
+  if (box.empty()) return OUTSIDE;
+
+  vec3 c = box.center();
+  vec3 e = box.extent();
+  Result result = INSIDE;
+  for (int i = 0; i < 6; i++) {
+    vec3 n(planes[i]);
+    float dist = glm::dot(n, c) + planes[i].w;
+    float radius = glm::dot(e, glm::abs(n));
+    if (dist + radius < 0) return OUTSIDE;
+    if (dist - radius < 0) result = INTERSECTS;
+  }
+  return result;
+}
+
+bool intersectRay(const Ray &ray, const Aabb &box, float &t) {
+  if (box.empty()) return false;
+
+  // Slab test. Zero direction components give +-inf, which compare correctly.
+  vec3 inv = 1.0f / ray.direction;
+  vec3 t0 = (box.min - ray.origin) * inv;
+  vec3 t1 = (box.max - ray.origin) * inv;
+  vec3 tNear = glm::min(t0, t1);
+  vec3 tFar = glm::max(t0, t1);
+  float enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+  float exit = glm::min(glm::min(tFar.x, tFar.y), tFar.z);
+  if (enter > exit) return false;
+  t = enter;
+  return true;
+}
+
+bool intersectRay(const Ray &ray, const vec3 &center, float radius, float &t) {
+  vec3 oc = ray.origin - center;
+  float a = glm::dot(ray.direction, ray.direction);
+  float b = glm::dot(oc, ray.direction);
+  float c = glm::dot(oc, oc) - radius * radius;
+  float disc = b * b - a * c;
+  if (a == 0 || disc < 0) return false;
+
+  float root = glm::sqrt(disc);
+  float enter = (-b - root) / a;
+  float exit = (-b + root) / a;
+  if (exit < 0) return false;
+  t = enter >= 0 ? enter : exit;
+  return true;
+}
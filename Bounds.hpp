@@ -0,0 +1,56 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <limits>
+
+// Axis aligned bounding box. Default constructed boxes are empty.
+struct Aabb {
+  Aabb()
+    : min(std::numeric_limits<float>::max()),
+      max(-std::numeric_limits<float>::max()) {}
+  Aabb(const glm::vec3 &min, const glm::vec3 &max) : min(min), max(max) {}
+
+  bool empty() const { return min.x > max.x; }
+  glm::vec3 center() const { return (min + max) * 0.5f; }
+  glm::vec3 extent() const { return (max - min) * 0.5f; }
+
+  void expand(const glm::vec3 &p);
+  void expand(const Aabb &box);
+
+  bool operator==(const Aabb &o) const { return min == o.min && max == o.max; }
+  bool operator!=(const Aabb &o) const { return !(*this == o); }
+
+  glm::vec3 min;
+  glm::vec3 max;
+};
+
+// Bounds of box after being transformed by m (still axis aligned).
+Aabb transformAabb(const Aabb &box, const glm::mat4 &m);
+
+// The six clip planes of a projection * view matrix, normals pointing inwards.
+struct Frustum {
+  enum Result { OUTSIDE, INTERSECTS, INSIDE };
+
+  explicit Frustum(const glm::mat4 &viewProjection);
+
+  Result test(const Aabb &box) const;
+
+  glm::vec4 planes[6];
+};
+
+// Half line origin + t * direction for t >= 0.
+struct Ray {
+  Ray() {}
+  Ray(const glm::vec3 &origin, const glm::vec3 &direction) : origin(origin), direction(direction) {}
+
+  glm::vec3 at(float t) const { return origin + direction * t; }
+
+  glm::vec3 origin;
+  glm::vec3 direction;
+};
+
+// Distance along ray to where it enters box (0 if it starts inside).
+bool intersectRay(const Ray &ray, const Aabb &box, float &t);
+
+// Distance along ray to the nearest point on the sphere in front of the origin.
+bool intersectRay(const Ray &ray, const glm::vec3 &center, float radius, float &t);
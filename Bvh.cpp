@@ -0,0 +1,140 @@
+#include "Bvh.hpp"
+
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+void Bvh::build(const vector<Aabb> &leaves) {
+  m_leafBoxes = leaves;
+  m_nodes.clear();
+  m_leafOrder.resize(leaves.size());
+  m_leafNode.assign(leaves.size(), -1);
+  for (size_t i = 0; i < leaves.size(); i++) m_leafOrder[i] = i;
+
+  if (leaves.empty()) return;
+  m_nodes.reserve(2 * leaves.size() / MAX_LEAVES_PER_NODE + 1);
+  buildRecursive(-1, 0, leaves.size());
+}
+
+int Bvh::buildRecursive(int parent, int begin, int end) {
+  int index = m_nodes.size();
+  m_nodes.push_back(Node());
+  Node node;
+  node.parent = parent;
+  node.left = node.right = -1;
+  node.firstLeaf = begin;
+  node.numLeaves = end - begin;
+
+  Aabb centers;
+  for (int i = begin; i < end; i++) {
+    const Aabb &box = m_leafBoxes[m_leafOrder[i]];
+    node.box.expand(box);
+    if (!box.empty()) centers.expand(box.center());
+  }
+
+  if (end - begin <= MAX_LEAVES_PER_NODE) {
+    for (int i = begin; i < end; i++) m_leafNode[m_leafOrder[i]] = index;
+    m_nodes[index] = node;
+    return index;
+  }
+
+  // Median split along the longest axis of the leaf centers.
+  int axis = 0;
+  if (!centers.empty()) {
+    vec3 size = centers.max - centers.min;
+    if (size.y > size[axis]) axis = 1;
+    if (size.z > size[axis]) axis = 2;
+  }
+  int mid = (begin + end) / 2;
+  nth_element(m_leafOrder.begin() + begin, m_leafOrder.begin() + mid, m_leafOrder.begin() + end,
+      [this, axis](int a, int b) {
+    return m_leafBoxes[a].center()[axis] < m_leafBoxes[b].center()[axis];
+  });
+
+  node.left = buildRecursive(index, begin, mid);
+  node.right = buildRecursive(index, mid, end);
+  m_nodes[index] = node;
+  return index;
+}
+
+Aabb Bvh::nodeBounds(const Node &node) const {
+  Aabb box;
+  if (node.left < 0) {
+    for (int i = 0; i < node.numLeaves; i++) {
+      box.expand(m_leafBoxes[m_leafOrder[node.firstLeaf + i]]);
+    }
+  } else {
+    box.expand(m_nodes[node.left].box);
+    box.expand(m_nodes[node.right].box);
+  }
+  return box;
+}
+
+void Bvh::refitLeaf(size_t leaf, const Aabb &box) {
+  m_leafBoxes[leaf] = box;
+  for (int n = m_leafNode[leaf]; n >= 0; n = m_nodes[n].parent) {
+    Aabb refit = nodeBounds(m_nodes[n]);
+    if (refit == m_nodes[n].box) break; // nothing above this changes either
+    m_nodes[n].box = refit;
+  }
+}
+
+void Bvh::markLeaves(const Node &node, vector<char> &visible) const {
+  for (int i = 0; i < node.numLeaves; i++) {
+    visible[m_leafOrder[node.firstLeaf + i]] = 1;
+  }
+}
+
+void Bvh::query(const Frustum &frustum, vector<char> &visible) const {
+  visible.assign(m_leafBoxes.size(), 0);
+  if (m_nodes.empty()) return;
+
+  vector<int> stack(1, 0);
+  while (!stack.empty()) {
+    const Node &node = m_nodes[stack.back()];
+    stack.pop_back();
+
+    Frustum::Result result = frustum.test(node.box);
+    if (result == Frustum::OUTSIDE) continue;
+
+    // Every leaf under a fully contained node is visible.
+    if (result == Frustum::INSIDE) {
+      markLeaves(node, visible);
+      continue;
+    }
+
+    if (node.left < 0) {
+      for (int i = 0; i < node.numLeaves; i++) {
+        int leaf = m_leafOrder[node.firstLeaf + i];
+        if (frustum.test(m_leafBoxes[leaf]) != Frustum::OUTSIDE) visible[leaf] = 1;
+      }
+    } else {
+      stack.push_back(node.left);
+      stack.push_back(node.right);
+    }
+  }
+}
+
+void Bvh::query(const Ray &ray, float maxT, vector<size_t> &leaves) const {
+  if (m_nodes.empty()) return;
+
+  float t;
+  vector<int> stack(1, 0);
+  while (!stack.empty()) {
+    const Node &node = m_nodes[stack.back()];
+    stack.pop_back();
+
+    if (!intersectRay(ray, node.box, t) || t > maxT) continue;
+
+    if (node.left < 0) {
+      for (int i = 0; i < node.numLeaves; i++) {
+        int leaf = m_leafOrder[node.firstLeaf + i];
+        if (intersectRay(ray, m_leafBoxes[leaf], t) && t <= maxT) leaves.push_back(leaf);
+      }
+    } else {
+      stack.push_back(node.left);
+      stack.push_back(node.right);
+    }
+  }
+}
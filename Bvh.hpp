@@ -0,0 +1,45 @@
+#pragma once
+
+#include "Bounds.hpp"
+
+#include <vector>
+
+// Bounding volume hierarchy over a set of leaf boxes (one per drawn mesh
+// instance). Built top down once, then refitted in place as leaves move so
+// that only the ancestors of moved leaves are touched.
+class Bvh {
+public:
+  // Rebuild the tree from scratch. Leaf i keeps id i.
+  void build(const std::vector<Aabb> &leaves);
+
+  // Move leaf to box and refit its ancestors.
+  void refitLeaf(size_t leaf, const Aabb &box);
+
+  // visible[i] is set to 1 if leaf i may intersect the frustum, 0 otherwise.
+  void query(const Frustum &frustum, std::vector<char> &visible) const;
+
+  // Append every leaf whose box the ray enters before maxT.
+  void query(const Ray &ray, float maxT, std::vector<size_t> &leaves) const;
+
+  size_t numLeaves() const { return m_leafBoxes.size(); }
+  const Aabb &leafBounds(size_t leaf) const { return m_leafBoxes[leaf]; }
+
+private:
+  static const int MAX_LEAVES_PER_NODE = 4;
+
+  struct Node {
+    Aabb box;
+    int parent;
+    int left, right;          // children, -1 for leaf nodes
+    int firstLeaf, numLeaves; // range in m_leafOrder for leaf nodes
+  };
+
+  int buildRecursive(int parent, int begin, int end);
+  Aabb nodeBounds(const Node &node) const;
+  void markLeaves(const Node &node, std::vector<char> &visible) const;
+
+  std::vector<Node> m_nodes;
+  std::vector<Aabb> m_leafBoxes;
+  std::vector<int> m_leafOrder; // leaf ids, grouped by owning leaf node
+  std::vector<int> m_leafNode;  // leaf id -> owning leaf node
+};
@@ -0,0 +1,154 @@
+#include "ClusteredLights.hpp"
+#include "cs488-framework/GlErrorCheck.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace glm;
+
+// Texture buffers cannot be empty.
+static const size_t MIN_BUFFER_SIZE = 16;
+
+//---------------------------------------------------------------------------------------
+ClusteredLights::ClusteredLights()
+  : m_zScale(0),
+    m_zBias(0),
+    m_maxPerCluster(0)
+{
+  m_lights.buffer = m_lights.texture = 0;
+  m_clusters.buffer = m_clusters.texture = 0;
+  m_lightIndices.buffer = m_lightIndices.texture = 0;
+}
+
+void ClusteredLights::init() {
+  initBuffer(m_lights, GL_RGBA32F);
+  initBuffer(m_clusters, GL_RG32UI);
+  initBuffer(m_lightIndices, GL_R32UI);
+  m_clusterData.assign(2 * NUM_CLUSTERS, 0);
+}
+
+void ClusteredLights::initBuffer(TextureBuffer &buffer, GLenum format) {
+  glGenBuffers(1, &buffer.buffer);
+  glBindBuffer(GL_TEXTURE_BUFFER, buffer.buffer);
+  glBufferData(GL_TEXTURE_BUFFER, MIN_BUFFER_SIZE, nullptr, GL_STREAM_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+  glGenTextures(1, &buffer.texture);
+  glBindTexture(GL_TEXTURE_BUFFER, buffer.texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, format, buffer.buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  CHECK_GL_ERRORS;
+}
+
+void ClusteredLights::release() {
+  TextureBuffer *buffers[3] = {&m_lights, &m_clusters, &m_lightIndices};
+  for (TextureBuffer *buffer : buffers) {
+    if (buffer->buffer) glDeleteBuffers(1, &buffer->buffer);
+    if (buffer->texture) glDeleteTextures(1, &buffer->texture);
+    buffer->buffer = buffer->texture = 0;
+  }
+}
+
+//---------------------------------------------------------------------------------------
+int ClusteredLights::slice(float depth) const {
+  return glm::clamp((int)std::floor(std::log(depth) * m_zScale + m_zBias), 0, CLUSTERS_Z - 1);
+}
+
+// NDC range covered by [c - r, c + r] anywhere between view depths dMin and
+// dMax; x / d is monotonic in d, so the extremes are at the corners.
+static void ndcRange(float c, float r, float scale, float dMin, float dMax, float &lo, float &hi) {
+  lo = scale * std::min((c - r) / dMin, (c - r) / dMax);
+  hi = scale * std::max((c + r) / dMin, (c + r) / dMax);
+}
+
+static int tile(float ndc, int tiles) {
+  return glm::clamp((int)std::floor((ndc * 0.5f + 0.5f) * tiles), 0, tiles - 1);
+}
+
+void ClusteredLights::assign(const vector<PointLight> &lights, const mat4 &view,
+    const mat4 &projection, float zNear, float zFar) {
+  m_zScale = CLUSTERS_Z / std::log(zFar / zNear);
+  m_zBias = -std::log(zNear) * m_zScale;
+
+  m_lightData.clear();
+  m_bounds.clear();
+  m_indices.clear();
+  m_clusterData.assign(2 * NUM_CLUSTERS, 0);
+  m_maxPerCluster = 0;
+
+  // Bound each light by the clusters its sphere's view space box overlaps.
+  for (const PointLight &light : lights) {
+    if (m_bounds.size() == MAX_POINT_LIGHTS) break;
+    float r = light.radius;
+    vec3 p = vec3(view * vec4(light.position, 1.0f));
+    float d = -p.z;
+    if (r <= 0 || d + r <= zNear || d - r >= zFar) continue;
+    float dMin = std::max(zNear, d - r), dMax = std::min(zFar, d + r);
+
+    float xLo, xHi, yLo, yHi;
+    ndcRange(p.x, r, projection[0][0], dMin, dMax, xLo, xHi);
+    ndcRange(p.y, r, projection[1][1], dMin, dMax, yLo, yHi);
+    if (xHi < -1 || xLo > 1 || yHi < -1 || yLo > 1) continue;
+
+    LightBounds bounds;
+    bounds.min[0] = tile(xLo, CLUSTERS_X); bounds.max[0] = tile(xHi, CLUSTERS_X);
+    bounds.min[1] = tile(yLo, CLUSTERS_Y); bounds.max[1] = tile(yHi, CLUSTERS_Y);
+    bounds.min[2] = slice(dMin);           bounds.max[2] = slice(dMax);
+    m_bounds.push_back(bounds);
+    m_lightData.push_back(vec4(light.position, r));
+    m_lightData.push_back(vec4(light.colour, 0.0f));
+  }
+
+  // Count, prefix sum, then fill each cluster's list.
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < m_bounds.size(); i++) {
+      const LightBounds &b = m_bounds[i];
+      for (int z = b.min[2]; z <= b.max[2]; z++) {
+        for (int y = b.min[1]; y <= b.max[1]; y++) {
+          for (int x = b.min[0]; x <= b.max[0]; x++) {
+            uint32_t *cluster = &m_clusterData[2 * ((z * CLUSTERS_Y + y) * CLUSTERS_X + x)];
+            if (pass == 1) m_indices[cluster[0] + cluster[1]] = (uint32_t)i;
+            cluster[1]++;
+          }
+        }
+      }
+    }
+    if (pass == 1) break;
+
+    uint32_t first = 0;
+    for (int c = 0; c < NUM_CLUSTERS; c++) {
+      uint32_t count = m_clusterData[2 * c + 1];
+      m_maxPerCluster = std::max(m_maxPerCluster, count);
+      m_clusterData[2 * c] = first;
+      m_clusterData[2 * c + 1] = 0;
+      first += count;
+    }
+    m_indices.resize(first);
+  }
+}
+
+//---------------------------------------------------------------------------------------
+void ClusteredLights::upload() {
+  uploadBuffer(m_lights, LIGHTS_TEXTURE_UNIT, m_lightData.data(), m_lightData.size() * sizeof(vec4));
+  uploadBuffer(m_clusters, CLUSTERS_TEXTURE_UNIT, m_clusterData.data(), m_clusterData.size() * sizeof(uint32_t));
+  uploadBuffer(m_lightIndices, LIGHT_INDICES_TEXTURE_UNIT, m_indices.data(), m_indices.size() * sizeof(uint32_t));
+  glActiveTexture(GL_TEXTURE0);
+  CHECK_GL_ERRORS;
+}
+
+void ClusteredLights::uploadBuffer(const TextureBuffer &buffer, GLuint unit, const void *data, size_t bytes) {
+  glBindBuffer(GL_TEXTURE_BUFFER, buffer.buffer);
+  // A new store each frame, so the driver need not wait on draws still
+  // reading the last one.
+  if (bytes < MIN_BUFFER_SIZE) {
+    glBufferData(GL_TEXTURE_BUFFER, MIN_BUFFER_SIZE, nullptr, GL_STREAM_DRAW);
+    if (bytes) glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+  } else {
+    glBufferData(GL_TEXTURE_BUFFER, bytes, data, GL_STREAM_DRAW);
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_BUFFER, buffer.texture);
+}
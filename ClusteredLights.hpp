@@ -0,0 +1,91 @@
+#pragma once
+
+#include "cs488-framework/OpenGLImport.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A light with a finite range, in world space.
+struct PointLight {
+  PointLight() : position(0.0f), radius(0.0f), colour(0.0f) {}
+  PointLight(const glm::vec3 &position, float radius, const glm::vec3 &colour)
+    : position(position), radius(radius), colour(colour) {}
+  glm::vec3 position;
+  float radius;      // no contribution at or beyond this distance
+  glm::vec3 colour;  // rgb intensity
+};
+
+// The view frustum is cut into CLUSTERS_X x CLUSTERS_Y screen tiles and
+// CLUSTERS_Z slices, spaced exponentially in view depth. The same constants are
+// declared in FragmentShader.fs.
+static const int CLUSTERS_X = 16;
+static const int CLUSTERS_Y = 9;
+static const int CLUSTERS_Z = 24;
+static const int NUM_CLUSTERS = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+static const size_t MAX_POINT_LIGHTS = 1024;
+
+// Texture units of the three light buffers, after the RenderState units.
+static const GLuint LIGHTS_TEXTURE_UNIT = 3;
+static const GLuint CLUSTERS_TEXTURE_UNIT = 4;
+static const GLuint LIGHT_INDICES_TEXTURE_UNIT = 5;
+
+// Clustered forward shading. assign() finds, on the CPU, every cluster each
+// light's bounding sphere may touch; upload() hands the result to the scene
+// program as three texture buffers:
+//   lights:   two RGBA32F texels per light, position and radius, then colour
+//   clusters: one RG32UI texel per cluster, its first light index and count
+//   indices:  R32UI light indices, the lists of every cluster back to back
+// so each fragment only loops over the lights of its own cluster.
+class ClusteredLights {
+public:
+  ClusteredLights();
+
+  void init();
+  void release();
+
+  // CPU stage. projection must be a symmetric perspective matrix.
+  void assign(const std::vector<PointLight> &lights, const glm::mat4 &view,
+      const glm::mat4 &projection, float zNear, float zFar);
+  // GL stage: upload the last assignment and bind it to the texture units.
+  void upload();
+
+  // A view depth d falls in slice log(d) * zScale() + zBias().
+  float zScale() const { return m_zScale; }
+  float zBias() const { return m_zBias; }
+
+  size_t numLights() const { return m_lightData.size() / 2; }
+  size_t numIndices() const { return m_indices.size(); }
+  unsigned int maxPerCluster() const { return m_maxPerCluster; }
+
+private:
+  // Cluster ranges touched by one light, inclusive.
+  struct LightBounds {
+    int min[3];
+    int max[3];
+  };
+
+  struct TextureBuffer {
+    GLuint buffer;
+    GLuint texture;
+  };
+
+  void initBuffer(TextureBuffer &buffer, GLenum format);
+  void uploadBuffer(const TextureBuffer &buffer, GLuint unit, const void *data, size_t bytes);
+  int slice(float depth) const;
+
+  float m_zScale;
+  float m_zBias;
+  unsigned int m_maxPerCluster;
+
+  std::vector<LightBounds> m_bounds;
+  std::vector<glm::vec4> m_lightData;
+  std::vector<uint32_t> m_clusterData; // first index and count per cluster
+  std::vector<uint32_t> m_indices;
+
+  TextureBuffer m_lights;
+  TextureBuffer m_clusters;
+  TextureBuffer m_lightIndices;
+};
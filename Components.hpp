@@ -0,0 +1,133 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+class SceneNode;
+
+// Entities are ids handed out by SceneComponents::create(). A bubble node keeps
+// its id in BubbleNode::m_entity.
+typedef unsigned int EntityId;
+static const EntityId NO_ENTITY = (EntityId)-1;
+
+// Dense storage of one component type. Components are packed contiguously (in
+// no particular order) so systems can loop over them directly; a sparse table
+// maps entity ids to their slot. Removal swaps the last component into the hole.
+template <typename T>
+class ComponentArray {
+public:
+  T & add(EntityId id, const T & value = T()) {
+    if (id >= m_sparse.size()) m_sparse.resize(id + 1, INVALID);
+    assert(m_sparse[id] == INVALID);
+    m_sparse[id] = m_dense.size();
+    m_dense.push_back(value);
+    m_entities.push_back(id);
+    return m_dense.back();
+  }
+
+  void remove(EntityId id) {
+    if (!has(id)) return;
+    size_t slot = m_sparse[id];
+    size_t last = m_dense.size() - 1;
+    if (slot != last) {
+      m_dense[slot] = m_dense[last];
+      m_entities[slot] = m_entities[last];
+      m_sparse[m_entities[slot]] = slot;
+    }
+    m_dense.pop_back();
+    m_entities.pop_back();
+    m_sparse[id] = INVALID;
+  }
+
+  bool has(EntityId id) const {
+    return id < m_sparse.size() && m_sparse[id] != INVALID;
+  }
+
+  T & get(EntityId id) { assert(has(id)); return m_dense[m_sparse[id]]; }
+  const T & get(EntityId id) const { assert(has(id)); return m_dense[m_sparse[id]]; }
+
+  size_t size() const { return m_dense.size(); }
+  T & operator[](size_t slot) { return m_dense[slot]; }
+  const T & operator[](size_t slot) const { return m_dense[slot]; }
+  EntityId entity(size_t slot) const { return m_entities[slot]; }
+
+private:
+  static const size_t INVALID = (size_t)-1;
+
+  std::vector<T> m_dense;
+  std::vector<EntityId> m_entities; // slot -> entity
+  std::vector<size_t> m_sparse;     // entity -> slot
+};
+
+// Offset of an entity's node from its parent, applied on top of SceneNode::trans.
+struct TransformComponent {
+  TransformComponent() : position(0.0f) {}
+  explicit TransformComponent(const glm::vec3 &position) : position(position) {}
+  glm::vec3 position;
+};
+
+struct PhysicsBody {
+  PhysicsBody() : velocity(0.0f), radius(0.0f) {}
+  PhysicsBody(const glm::vec3 &velocity, float radius) : velocity(velocity), radius(radius) {}
+  glm::vec3 velocity; // distance moved per tick
+  float radius;       // collision sphere
+};
+
+// The node that draws an entity.
+struct RenderableComponent {
+  RenderableComponent() : node(nullptr) {}
+  explicit RenderableComponent(SceneNode *node) : node(node) {}
+  SceneNode *node;
+};
+
+struct BubbleColour {
+  BubbleColour() : type(0) {}
+  explicit BubbleColour(size_t type) : type(type) {}
+  size_t type;
+};
+
+// All simulation state, kept out of the scene graph so only entities that need
+// a component pay for it.
+//
+// Bodies are only added together with a transform (addBody) and removed
+// together with it (destroy), and removal moves the same entity in both arrays,
+// so slot b of bodies and slot b of transforms always belong to one entity.
+// Physics walks the two side by side.
+struct SceneComponents {
+  SceneComponents() : m_nextId(0) {}
+
+  ComponentArray<TransformComponent> transforms;
+  ComponentArray<PhysicsBody> bodies;
+  ComponentArray<RenderableComponent> renderables;
+  ComponentArray<BubbleColour> colours;
+
+  // Ids of destroyed entities are handed out again, so the sparse tables only
+  // grow to the most entities alive at once.
+  EntityId create() {
+    if (m_freeIds.empty()) return m_nextId++;
+    EntityId id = m_freeIds.back();
+    m_freeIds.pop_back();
+    return id;
+  }
+
+  void addBody(EntityId id, const TransformComponent & transform, const PhysicsBody & body) {
+    assert(!transforms.has(id));
+    transforms.add(id, transform);
+    bodies.add(id, body);
+  }
+
+  void destroy(EntityId id) {
+    transforms.remove(id);
+    bodies.remove(id);
+    renderables.remove(id);
+    colours.remove(id);
+    m_freeIds.push_back(id);
+  }
+
+private:
+  EntityId m_nextId;
+  std::vector<EntityId> m_freeIds;
+};
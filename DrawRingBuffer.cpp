@@ -0,0 +1,120 @@
+#include "DrawRingBuffer.hpp"
+#include "cs488-framework/GlErrorCheck.hpp"
+
+#include <cstring>
+
+//---------------------------------------------------------------------------------------
+DrawRingBuffer::DrawRingBuffer()
+  : m_buffer(0),
+    m_persistent(false),
+    m_mapped(nullptr),
+    m_regionSize(0),
+    m_region(0),
+    m_stalls(0)
+{
+  for (int i = 0; i < FRAMES; i++) m_fences[i] = nullptr;
+}
+
+void DrawRingBuffer::init(size_t bytesPerFrame) {
+  GLint major = 0, minor = 0;
+  glGetIntegerv(GL_MAJOR_VERSION, &major);
+  glGetIntegerv(GL_MINOR_VERSION, &minor);
+  m_persistent = major > 4 || (major == 4 && minor >= 4);
+  create(bytesPerFrame);
+}
+
+//---------------------------------------------------------------------------------------
+void DrawRingBuffer::create(size_t bytesPerFrame) {
+  m_regionSize = bytesPerFrame;
+  m_region = 0;
+  glGenBuffers(1, &m_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+  if (m_persistent) {
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, FRAMES * m_regionSize, nullptr, flags);
+    m_mapped = (char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, FRAMES * m_regionSize, flags);
+    if (!m_mapped) {
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      glDeleteBuffers(1, &m_buffer);
+      m_persistent = false;
+      create(bytesPerFrame);
+      return;
+    }
+  } else {
+    glBufferData(GL_ARRAY_BUFFER, m_regionSize, nullptr, GL_STREAM_DRAW);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  CHECK_GL_ERRORS;
+}
+
+// Only called to grow the buffer, which is rare enough to simply wait for the GPU.
+void DrawRingBuffer::destroy() {
+  glFinish();
+  for (int i = 0; i < FRAMES; i++) {
+    if (m_fences[i]) glDeleteSync(m_fences[i]);
+    m_fences[i] = nullptr;
+  }
+  if (m_mapped) {
+    glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    m_mapped = nullptr;
+  }
+  glDeleteBuffers(1, &m_buffer);
+  m_buffer = 0;
+}
+
+//---------------------------------------------------------------------------------------
+size_t DrawRingBuffer::upload(const void *data, size_t bytes) {
+  if (bytes > m_regionSize) {
+    size_t size = m_regionSize;
+    while (size < bytes) size *= 2;
+    destroy();
+    create(size);
+  }
+
+  if (!m_persistent) {
+    // Orphan the old storage instead of waiting for draws still reading it.
+    glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+    glBufferData(GL_ARRAY_BUFFER, m_regionSize, nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, data);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return 0;
+  }
+
+  m_region = (m_region + 1) % FRAMES;
+  GLsync fence = m_fences[m_region];
+  if (fence) {
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+      m_stalls++;
+      glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    }
+    glDeleteSync(fence);
+    m_fences[m_region] = nullptr;
+  }
+
+  size_t offset = m_region * m_regionSize;
+  if (bytes > 0) memcpy(m_mapped + offset, data, bytes);
+  return offset;
+}
+
+void DrawRingBuffer::endFrame() {
+  if (!m_persistent) return;
+  m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+//---------------------------------------------------------------------------------------
+glm::mat3 normalMatrix(const glm::mat4 &model) {
+  const float EPSILON = 1e-4f;
+  glm::mat3 m(model);
+  float xx = glm::dot(m[0], m[0]), yy = glm::dot(m[1], m[1]), zz = glm::dot(m[2], m[2]);
+  float tolerance = EPSILON * glm::max(xx, glm::max(yy, zz));
+  // Orthogonal axes of equal length: rotation times uniform scale.
+  if (glm::abs(xx - yy) <= tolerance && glm::abs(xx - zz) <= tolerance &&
+      glm::abs(glm::dot(m[0], m[1])) <= tolerance &&
+      glm::abs(glm::dot(m[0], m[2])) <= tolerance &&
+      glm::abs(glm::dot(m[1], m[2])) <= tolerance) {
+    return m;
+  }
+  return glm::transpose(glm::inverse(m));
+}
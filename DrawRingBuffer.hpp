@@ -0,0 +1,86 @@
+#pragma once
+
+#include "cs488-framework/OpenGLImport.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+
+// Per-instance data of the scene programs, read through instanced vertex
+// attributes (see SceneGraphShader::setInstanceOffset).
+struct InstanceData {
+  glm::mat4 model;
+  glm::mat3 normal; // inverse transpose of the model's upper 3x3, see normalMatrix
+  GLint material;   // index into the Materials block
+  GLint mesh;       // index into the Meshes block
+  GLint pad;
+};
+
+static_assert(sizeof(InstanceData) == 112, "InstanceData must stay tightly packed");
+
+// Transforms normals and tangents by `model`. Without non-uniform scale the
+// inverse transpose only differs from the model's own 3x3 by a factor, which
+// the shader's normalize() removes, so the inverse is skipped.
+glm::mat3 normalMatrix(const glm::mat4 &model);
+
+// One entry of the std140 Materials uniform block, which holds every
+// RenderMaterial of the scene (see Project::uploadMaterialTable).
+struct MaterialData {
+  glm::vec3 kd;
+  float shininess;
+  glm::vec3 ks;
+  float transparency;
+};
+
+static_assert(sizeof(MaterialData) == 32, "MaterialData must follow the std140 layout");
+
+static const int MAX_MATERIALS = 256;
+static const GLuint MATERIALS_BINDING = 1;
+static const char * const MATERIALS_BLOCK = "Materials";
+
+// One entry of the std140 Meshes uniform block: how to expand each mesh's
+// stored vertex positions (see MeshBatch and Project::uploadMeshTable).
+struct MeshData {
+  glm::vec4 positionScale;
+  glm::vec4 positionBias;
+};
+
+static const int MAX_MESHES = 256;
+static const GLuint MESHES_BINDING = 2;
+static const char * const MESHES_BLOCK = "Meshes";
+
+// Streams per-frame draw data to the GPU. The buffer is split in FRAMES
+// regions written in turn; each is fenced after the frame which used it, so
+// by the time it comes round again the GPU is done with it and the CPU does
+// not wait. Uses a persistently mapped buffer on GL 4.4, and otherwise
+// orphans a single region every frame.
+class DrawRingBuffer {
+public:
+  static const int FRAMES = 3;
+
+  DrawRingBuffer();
+
+  void init(size_t bytesPerFrame);
+
+  // Copy this frame's data in with one memcpy. Returns its offset in buffer().
+  size_t upload(const void *data, size_t bytes);
+  // Fence the region written by the last upload().
+  void endFrame();
+
+  GLuint buffer() const { return m_buffer; }
+  bool persistent() const { return m_persistent; }
+  // Uploads which found their region still in use.
+  int stalls() const { return m_stalls; }
+
+private:
+  void create(size_t bytesPerFrame);
+  void destroy();
+
+  GLuint m_buffer;
+  bool m_persistent;
+  char *m_mapped;
+  size_t m_regionSize;
+  int m_region;
+  GLsync m_fences[FRAMES];
+  int m_stalls;
+};
@@ -0,0 +1,113 @@
+#include "FrameProfiler.hpp"
+#include "cs488-framework/GlErrorCheck.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+using namespace std;
+
+const char * frameStageName(FrameStage stage) {
+  static const char * const NAMES[NUM_FRAME_STAGES] = {
+    "build", "shadow", "skybox", "opaque", "transparent", "ui", "blur", "present"
+  };
+  return NAMES[stage];
+}
+
+//---------------------------------------------------------------------------------------
+void FrameProfiler::Samples::add(float value) {
+  values[next] = value;
+  next = (next + 1) % HISTORY;
+  count = std::min(count + 1, HISTORY);
+}
+
+FrameProfiler::Stats FrameProfiler::Samples::stats() const {
+  Stats stats;
+  if (count == 0) return stats;
+  vector<float> sorted(values, values + count);
+  sort(sorted.begin(), sorted.end());
+  float sum = 0;
+  for (float value : sorted) sum += value;
+  stats.mean = sum / count;
+  stats.p50 = sorted[(count - 1) / 2];
+  stats.p95 = sorted[(count - 1) * 95 / 100];
+  stats.max = sorted.back();
+  stats.samples = count;
+  return stats;
+}
+
+//---------------------------------------------------------------------------------------
+FrameProfiler::FrameProfiler()
+  : m_set(0),
+    m_dropped(0)
+{
+  for (int i = 0; i < QUERY_FRAMES; i++) {
+    for (int s = 0; s < NUM_FRAME_STAGES; s++) {
+      m_queries[i][s] = 0;
+      m_issued[i][s] = false;
+    }
+  }
+}
+
+void FrameProfiler::init() {
+  glGenQueries(QUERY_FRAMES * NUM_FRAME_STAGES, &m_queries[0][0]);
+  CHECK_GL_ERRORS;
+}
+
+void FrameProfiler::release() {
+  if (m_queries[0][0]) glDeleteQueries(QUERY_FRAMES * NUM_FRAME_STAGES, &m_queries[0][0]);
+  for (int i = 0; i < QUERY_FRAMES; i++) {
+    for (int s = 0; s < NUM_FRAME_STAGES; s++) {
+      m_queries[i][s] = 0;
+      m_issued[i][s] = false;
+    }
+  }
+}
+
+// Move on to the oldest set of queries, collecting whatever it measured
+// QUERY_FRAMES frames ago.
+void FrameProfiler::beginFrame() {
+  m_set = (m_set + 1) % QUERY_FRAMES;
+  for (int s = 0; s < NUM_FRAME_STAGES; s++) {
+    if (!m_issued[m_set][s]) continue;
+    m_issued[m_set][s] = false;
+    GLint available = 0;
+    glGetQueryObjectiv(m_queries[m_set][s], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      m_dropped++;
+      continue;
+    }
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v(m_queries[m_set][s], GL_QUERY_RESULT, &nanoseconds);
+    m_gpu[s].add(nanoseconds * 1e-6f);
+  }
+}
+
+void FrameProfiler::begin(FrameStage stage) {
+  m_cpuStart[stage] = Clock::now();
+  if (m_queries[m_set][stage]) glBeginQuery(GL_TIME_ELAPSED, m_queries[m_set][stage]);
+}
+
+void FrameProfiler::end(FrameStage stage) {
+  if (m_queries[m_set][stage]) {
+    glEndQuery(GL_TIME_ELAPSED);
+    m_issued[m_set][stage] = true;
+  }
+  m_cpu[stage].add(chrono::duration<float, milli>(Clock::now() - m_cpuStart[stage]).count());
+}
+
+//---------------------------------------------------------------------------------------
+bool FrameProfiler::exportCsv(const string &path) const {
+  ofstream file(path.c_str());
+  if (!file) return false;
+  file << "stage,clock,samples,mean_ms,p50_ms,p95_ms,max_ms\n";
+  for (int s = 0; s < NUM_FRAME_STAGES; s++) {
+    const Stats stats[2] = {m_cpu[s].stats(), m_gpu[s].stats()};
+    for (int clock = 0; clock < 2; clock++) {
+      file << frameStageName((FrameStage)s) << "," << (clock == 0 ? "cpu" : "gpu") << ","
+           << stats[clock].samples << "," << stats[clock].mean << "," << stats[clock].p50 << ","
+           << stats[clock].p95 << "," << stats[clock].max << "\n";
+    }
+  }
+  return (bool)file;
+}
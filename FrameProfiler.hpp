@@ -0,0 +1,90 @@
+#pragma once
+
+#include "cs488-framework/OpenGLImport.hpp"
+
+#include <chrono>
+#include <string>
+
+// The timed stages of Project::draw(), in frame order.
+enum FrameStage {
+  STAGE_BUILD,       // buildDrawLists() and the per-frame uploads
+  STAGE_SHADOW,
+  STAGE_SKYBOX,
+  STAGE_OPAQUE,
+  STAGE_TRANSPARENT,
+  STAGE_UI,
+  STAGE_BLUR,        // blur history update
+  STAGE_PRESENT,     // final composite
+  NUM_FRAME_STAGES
+};
+
+const char * frameStageName(FrameStage stage);
+
+// CPU and GPU time of every FrameStage. Each stage is bracketed by a pair of
+// steady_clock reads and a GL_TIME_ELAPSED query. Queries live in a ring of
+// QUERY_FRAMES sets and are only read back once their set comes round again,
+// and only if the result is already available, so reading them never stalls.
+// The last HISTORY samples of each are kept for averages and percentiles.
+class FrameProfiler {
+public:
+  static const int QUERY_FRAMES = 4;
+  static const int HISTORY = 240;
+
+  struct Stats {
+    Stats() : mean(0), p50(0), p95(0), max(0), samples(0) {}
+    float mean, p50, p95, max; // milliseconds
+    int samples;
+  };
+
+  FrameProfiler();
+
+  void init();
+  void release();
+
+  // Call once per frame before the first begin().
+  void beginFrame();
+  void begin(FrameStage stage);
+  void end(FrameStage stage);
+
+  Stats cpuStats(FrameStage stage) const { return m_cpu[stage].stats(); }
+  Stats gpuStats(FrameStage stage) const { return m_gpu[stage].stats(); }
+  // Queries dropped because their result was not ready a full ring later.
+  int dropped() const { return m_dropped; }
+
+  // Write the statistics of every stage as CSV.
+  bool exportCsv(const std::string &path) const;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Samples {
+    Samples() : count(0), next(0) {}
+    void add(float value);
+    Stats stats() const;
+
+    float values[HISTORY];
+    int count;
+    int next;
+  };
+
+  GLuint m_queries[QUERY_FRAMES][NUM_FRAME_STAGES];
+  bool m_issued[QUERY_FRAMES][NUM_FRAME_STAGES];
+  int m_set;
+  int m_dropped;
+
+  Clock::time_point m_cpuStart[NUM_FRAME_STAGES];
+  Samples m_cpu[NUM_FRAME_STAGES];
+  Samples m_gpu[NUM_FRAME_STAGES];
+};
+
+// Times the enclosing scope as one FrameStage.
+class ScopedStageTimer {
+public:
+  ScopedStageTimer(FrameProfiler &profiler, FrameStage stage)
+    : m_profiler(profiler), m_stage(stage) { m_profiler.begin(m_stage); }
+  ~ScopedStageTimer() { m_profiler.end(m_stage); }
+
+private:
+  FrameProfiler &m_profiler;
+  FrameStage m_stage;
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "cs488-framework/OpenGLImport.hpp"
+
+#include <glm/glm.hpp>
+
+// Constants shared by every scene program for one frame, uploaded once per frame
+// into a std140 uniform buffer bound at FRAME_UNIFORMS_BINDING. The layout must
+// match the FrameUniforms block in Assets/UniformBlocks.glsl.
+struct FrameUniforms {
+  glm::mat4 perspective;
+  glm::mat4 view;
+  glm::mat4 lightSpaceMatrix;
+  glm::vec3 viewPos;          float pad0;
+  glm::vec3 lightPosition;    float pad1;
+  glm::vec3 lightIntensity;   float pad2;
+  glm::vec3 ambientIntensity;
+  GLint showShadows;
+  GLint showTextures;
+  GLint showTransparent;
+  GLint showPointLights;
+  GLint pad3;
+  // Cluster of a fragment, see ClusteredLights: tile = gl_FragCoord.xy *
+  // clusterTileScale, slice = log(view depth) * clusterZScale + clusterZBias.
+  glm::vec2 clusterTileScale;
+  float clusterZScale;
+  float clusterZBias;
+};
+
+static_assert(sizeof(FrameUniforms) == 288, "FrameUniforms must follow the std140 layout");
+
+static const GLuint FRAME_UNIFORMS_BINDING = 0;
+static const char * const FRAME_UNIFORMS_BLOCK = "FrameUniforms";
@@ -11,7 +11,26 @@ GeometryNode::GeometryNode(
 		const std::string & name
 )
 	: SceneNode(name),
-	  meshId(meshId)
+	  meshId(meshId),
+	  meshHandle(-1),
+	  textureHandle(-1),
+	  bumpHandle(-1),
+	  materialHandle(-1)
 {
 	m_nodeType = NodeType::GeometryNode;
+	updateLayers();
+}
+
+//---------------------------------------------------------------------------------------
+void GeometryNode::updateLayers() {
+	unsigned int derived = material.transparency == 1
+		? LAYER_OPAQUE | LAYER_SHADOW_CASTER
+		: LAYER_TRANSPARENT;
+	m_layers &= ~(LAYER_OPAQUE | LAYER_SHADOW_CASTER | LAYER_TRANSPARENT);
+	m_layers |= (derived & ~m_disabledLayers) | m_forcedLayers;
+}
+
+//---------------------------------------------------------------------------------------
+const glm::mat4 BubbleNode::get_transform() const {
+	return glm::translate(mat4(), components.transforms.get(m_entity).position) * trans;
 }
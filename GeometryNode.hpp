@@ -1,6 +1,7 @@
 #pragma once
 
 #include "SceneNode.hpp"
+#include "Components.hpp"
 
 class GeometryNode : public SceneNode {
 public:
@@ -9,6 +10,10 @@ public:
 		const std::string & name
 	);
 
+	// Opaque materials cast shadows, others are drawn in the transparent pass.
+	// Call after changing the material.
+	virtual void updateLayers();
+
 	Material material;
 
 	// Mesh Identifier. This must correspond to an object name of
@@ -17,12 +22,30 @@ public:
   std::string texture;
   std::string bumpMap;
 
+  // Dense handles for meshId, texture and bumpMap, resolved once after the
+  // meshes and textures are loaded (see Project::resolveRenderHandles).
+  // Negative until resolved.
+  int meshHandle;
+  int textureHandle;
+  int bumpHandle;
+  int materialHandle; // Project::m_materials, shared by nodes with equal settings
+
 };
 
 
+// A bubble entity. Its position, physics and colour live in SceneComponents,
+// keyed by m_entity; the node only places its bubble type in the scene.
 struct BubbleNode : public SceneNode {
 	BubbleNode(
-		const std::string & name
-	) : SceneNode(name) {}
-  size_t type;
+		const std::string & name,
+		const SceneComponents & components,
+		EntityId entity
+	) : SceneNode(name), components(components), m_entity(entity) {
+		setLayer(LAYER_DYNAMIC, true);
+	}
+
+  virtual const glm::mat4 get_transform() const;
+
+  const SceneComponents & components;
+  EntityId m_entity;
 };
@@ -0,0 +1,298 @@
+#include "Headless.hpp"
+#include "Project.hpp"
+#include "cs488-framework/GlErrorCheck.hpp"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+//---------------------------------------------------------------------------------------
+bool parseHeadlessOptions(int argc, char **argv, HeadlessOptions &options) {
+  for (int i = 1; i + 1 < argc; i++) {
+    string arg = argv[i];
+    const char *value = argv[i + 1];
+    if (arg == "--headless") {
+      options.frames = atoi(value);
+    } else if (arg == "--size") {
+      sscanf(value, "%dx%d", &options.width, &options.height);
+    } else if (arg == "--dump") {
+      stringstream list(value);
+      string frame;
+      while (getline(list, frame, ',')) options.dumpFrames.push_back(atoi(frame.c_str()));
+    } else if (arg == "--out") {
+      options.outDir = value;
+    } else if (arg == "--csv") {
+      options.csvFile = value;
+    } else {
+      continue;
+    }
+    i++;
+  }
+  options.width = std::max(1, options.width);
+  options.height = std::max(1, options.height);
+  return options.frames > 0;
+}
+
+//---------------------------------------------------------------------------------------
+HeadlessContext::HeadlessContext()
+  : m_display(nullptr),
+    m_context(nullptr)
+{
+  EGLDisplay display = EGL_NO_DISPLAY;
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (getPlatformDisplay) {
+    display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  }
+  if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+  EGLint major, minor;
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+    cerr << "headless: no EGL display" << endl;
+    return;
+  }
+  m_display = display;
+
+  const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+  if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context")) {
+    cerr << "headless: EGL " << major << "." << minor << " lacks EGL_KHR_surfaceless_context" << endl;
+    return;
+  }
+
+  // No surface is ever made, but the surfaceless platform only has pbuffer
+  // configs and EGL_SURFACE_TYPE defaults to EGL_WINDOW_BIT.
+  const EGLint configAttribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint numConfigs = 0;
+  if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0 ||
+      !eglBindAPI(EGL_OPENGL_API)) {
+    cerr << "headless: no desktop OpenGL config" << endl;
+    return;
+  }
+
+  const EGLint contextAttribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+  if (context == EGL_NO_CONTEXT) {
+    cerr << "headless: could not create an OpenGL 3.3 core context" << endl;
+    return;
+  }
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+    cerr << "headless: could not make the context current" << endl;
+    eglDestroyContext(display, context);
+    return;
+  }
+  if (gl3wInit()) {
+    cerr << "headless: could not load OpenGL functions" << endl;
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    return;
+  }
+  m_context = context;
+  cout << "headless: " << glGetString(GL_RENDERER) << ", " << glGetString(GL_VERSION) << endl;
+}
+
+HeadlessContext::~HeadlessContext() {
+  if (!m_display) return;
+  if (m_context) {
+    eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(m_display, m_context);
+  }
+  eglTerminate(m_display);
+}
+
+//---------------------------------------------------------------------------------------
+// PNG with a zlib stream of stored (uncompressed) deflate blocks: larger files,
+// but no dependency.
+static uint32_t crc32(uint32_t crc, const unsigned char *data, size_t size) {
+  static uint32_t table[256];
+  if (!table[1]) {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      table[n] = c;
+    }
+  }
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static void putBigEndian(vector<unsigned char> &out, uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8) out.push_back((value >> shift) & 0xff);
+}
+
+static void writeChunk(ofstream &file, const char *type, const vector<unsigned char> &data) {
+  vector<unsigned char> chunk;
+  putBigEndian(chunk, data.size());
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  putBigEndian(chunk, crc32(0, &chunk[4], chunk.size() - 4));
+  file.write((const char *)chunk.data(), chunk.size());
+}
+
+bool writePng(const string &path, const unsigned char *rgba, int width, int height) {
+  ofstream file(path.c_str(), ios::binary);
+  if (!file) return false;
+  static const unsigned char SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  file.write((const char *)SIGNATURE, sizeof(SIGNATURE));
+
+  vector<unsigned char> header;
+  putBigEndian(header, width);
+  putBigEndian(header, height);
+  const unsigned char format[5] = {8, 6, 0, 0, 0}; // 8 bit RGBA, no interlace
+  header.insert(header.end(), format, format + 5);
+  writeChunk(file, "IHDR", header);
+
+  // Every row starts with filter type 0.
+  size_t rowSize = (size_t)width * 4;
+  vector<unsigned char> raw;
+  raw.reserve((rowSize + 1) * height);
+  for (int y = 0; y < height; y++) {
+    raw.push_back(0);
+    raw.insert(raw.end(), rgba + y * rowSize, rgba + (y + 1) * rowSize);
+  }
+
+  vector<unsigned char> zlib = {0x78, 0x01};
+  uint32_t a = 1, b = 0;
+  for (size_t first = 0; first < raw.size(); first += 65535) {
+    size_t size = std::min((size_t)65535, raw.size() - first);
+    zlib.push_back(first + size == raw.size() ? 1 : 0); // final block?
+    zlib.push_back(size & 0xff);
+    zlib.push_back(size >> 8);
+    zlib.push_back(~size & 0xff);
+    zlib.push_back((~size >> 8) & 0xff);
+    zlib.insert(zlib.end(), raw.begin() + first, raw.begin() + first + size);
+    for (size_t i = first; i < first + size; i++) {
+      a = (a + raw[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+  }
+  putBigEndian(zlib, (b << 16) | a);
+  writeChunk(file, "IDAT", zlib);
+  writeChunk(file, "IEND", vector<unsigned char>());
+  return (bool)file;
+}
+
+//---------------------------------------------------------------------------------------
+// Milliseconds spent in each part of one frame. draw is the CPU side of
+// draw(); total also waits for the GPU (glFinish).
+struct FrameTiming {
+  double logic;
+  double draw;
+  double total;
+};
+
+static void printStats(const char *name, vector<double> values) {
+  sort(values.begin(), values.end());
+  double sum = 0;
+  for (double v : values) sum += v;
+  size_t n = values.size();
+  printf("  %-6s mean %7.3f  p50 %7.3f  p95 %7.3f  max %7.3f ms\n", name, sum / n,
+      values[(n - 1) / 2], values[(size_t)((n - 1) * 0.95)], values[n - 1]);
+}
+
+int Project::runHeadless(const HeadlessOptions &options) {
+  m_headless = true;
+  m_windowWidth = m_framebufferWidth = options.width;
+  m_windowHeight = m_framebufferHeight = options.height;
+  init();
+
+  // The post chain composites into this instead of a window.
+  initWindowFBO(&m_fbo_output, &m_outputTexture, options.width, options.height, GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  CHECK_GL_ERRORS;
+
+  typedef chrono::steady_clock Clock;
+  vector<FrameTiming> timings;
+  timings.reserve(options.frames);
+  vector<unsigned char> pixels((size_t)options.width * options.height * 4);
+  vector<unsigned char> flipped(pixels.size());
+  size_t rowSize = (size_t)options.width * 4;
+
+  for (int frame = 0; frame < options.frames; frame++) {
+    Clock::time_point start = Clock::now();
+    appLogic();
+    Clock::time_point logicDone = Clock::now();
+    draw();
+    Clock::time_point drawDone = Clock::now();
+    glFinish();
+    Clock::time_point finished = Clock::now();
+
+    FrameTiming timing;
+    timing.logic = chrono::duration<double, milli>(logicDone - start).count();
+    timing.draw = chrono::duration<double, milli>(drawDone - logicDone).count();
+    timing.total = chrono::duration<double, milli>(finished - start).count();
+    timings.push_back(timing);
+
+    if (find(options.dumpFrames.begin(), options.dumpFrames.end(), frame) != options.dumpFrames.end()) {
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo_output);
+      glPixelStorei(GL_PACK_ALIGNMENT, 1);
+      glReadPixels(0, 0, options.width, options.height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+      // GL rows go bottom up.
+      for (int y = 0; y < options.height; y++) {
+        memcpy(&flipped[y * rowSize], &pixels[(options.height - 1 - y) * rowSize], rowSize);
+      }
+      char name[32];
+      snprintf(name, sizeof(name), "/frame%05d.png", frame);
+      if (!writePng(options.outDir + name, flipped.data(), options.width, options.height)) {
+        cerr << "headless: could not write " << options.outDir + name << endl;
+      }
+    }
+  }
+
+  printf("headless: %d frames at %dx%d\n", options.frames, options.width, options.height);
+  vector<double> logicTimes, drawTimes, totalTimes;
+  for (const FrameTiming &timing : timings) {
+    logicTimes.push_back(timing.logic);
+    drawTimes.push_back(timing.draw);
+    totalTimes.push_back(timing.total);
+  }
+  printStats("logic", logicTimes);
+  printStats("draw", drawTimes);
+  printStats("total", totalTimes);
+  printf("  per stage, mean (p95) ms:\n");
+  for (int s = 0; s < NUM_FRAME_STAGES; s++) {
+    FrameProfiler::Stats cpu = m_profiler.cpuStats((FrameStage)s);
+    FrameProfiler::Stats gpu = m_profiler.gpuStats((FrameStage)s);
+    printf("    %-11s cpu %7.3f (%7.3f)  gpu %7.3f (%7.3f)\n", frameStageName((FrameStage)s),
+        cpu.mean, cpu.p95, gpu.mean, gpu.p95);
+  }
+
+  if (!options.csvFile.empty()) {
+    ofstream csv(options.csvFile.c_str());
+    csv << "frame,logic_ms,draw_ms,total_ms\n";
+    for (size_t i = 0; i < timings.size(); i++) {
+      csv << i << "," << timings[i].logic << "," << timings[i].draw << "," << timings[i].total << "\n";
+    }
+  }
+
+  glDeleteFramebuffers(1, &m_fbo_output);
+  glDeleteTextures(1, &m_outputTexture);
+  m_fbo_output = m_outputTexture = 0;
+  cleanup();
+  return 0;
+}
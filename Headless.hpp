@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Command line of a headless run:
+//   --headless FRAMES   run FRAMES frames offscreen instead of opening a window
+//   --size WxH          render resolution (default 1024x768)
+//   --dump I,J,...      write those frames as PNGs
+//   --out DIR           directory for the PNGs (default .)
+//   --csv FILE          per-frame timings as CSV
+struct HeadlessOptions {
+  HeadlessOptions() : frames(0), width(1024), height(768), outDir(".") {}
+
+  int frames; // 0: not headless
+  int width;
+  int height;
+  std::vector<int> dumpFrames;
+  std::string outDir;
+  std::string csvFile;
+};
+
+// Fills options from argv. Returns false if --headless was not given.
+bool parseHeadlessOptions(int argc, char **argv, HeadlessOptions &options);
+
+// An OpenGL 3.3 core context without a window or display server, current on
+// the calling thread while this object lives. Uses EGL on the surfaceless
+// platform when the driver has it (Mesa, including llvmpipe for CPU only
+// machines), and the default EGL display otherwise.
+class HeadlessContext {
+public:
+  HeadlessContext();
+  ~HeadlessContext();
+
+  bool valid() const { return m_context != nullptr; }
+
+private:
+  void *m_display;
+  void *m_context;
+};
+
+// Write width x height RGBA pixels, top row first, as an 8 bit PNG.
+bool writePng(const std::string &path, const unsigned char *rgba, int width, int height);
@@ -1,6 +1,8 @@
 #include "Project.hpp"
+#include "Headless.hpp"
 
 #include <iostream>
+#include <memory>
 using namespace std;
 
 int main( int argc, char **argv ) 
@@ -10,6 +12,16 @@ int main( int argc, char **argv )
 		title += luaSceneFile;
 		title += "]";
 
+		// e.g. --headless 300 --size 1280x720 --dump 0,299 --out frames --csv timings.csv
+		HeadlessOptions headless;
+		if (parseHeadlessOptions(argc, argv, headless)) {
+			HeadlessContext context;
+			if (!context.valid()) return 1;
+			// The project must go before its context does.
+			std::unique_ptr<Project> project(new Project(luaSceneFile));
+			return project->runHeadless(headless);
+		}
+
 		CS488Window::launch(argc, argv, new Project(luaSceneFile), 1024, 768, title);
 
 	return 0;
@@ -0,0 +1,188 @@
+#include "MeshBuilder.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+
+using namespace std;
+using namespace glm;
+
+namespace {
+  struct VertexHash {
+    size_t operator()(const MeshVertex &v) const {
+      // FNV-1a over the raw bytes, to match VertexEqual.
+      const unsigned char *bytes = (const unsigned char *)&v;
+      size_t hash = 2166136261u;
+      for (size_t i = 0; i < sizeof(MeshVertex); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+      }
+      return hash;
+    }
+  };
+
+  struct VertexEqual {
+    bool operator()(const MeshVertex &a, const MeshVertex &b) const {
+      return memcmp(&a, &b, sizeof(MeshVertex)) == 0;
+    }
+  };
+}
+
+//---------------------------------------------------------------------------------------
+GLenum IndexedMeshes::indexType() const {
+  return vertices.size() <= 0xffff ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+size_t IndexedMeshes::indexSize() const {
+  return indexType() == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+vector<char> IndexedMeshes::packedIndices() const {
+  vector<char> packed(indices.size() * indexSize());
+  if (indexType() == GL_UNSIGNED_INT) {
+    memcpy(packed.data(), indices.data(), packed.size());
+  } else {
+    uint16_t *out = (uint16_t *)packed.data();
+    for (size_t i = 0; i < indices.size(); i++) out[i] = (uint16_t)indices[i];
+  }
+  return packed;
+}
+
+//---------------------------------------------------------------------------------------
+void buildIndexedMeshes(const MeshConsolidator &meshConsolidator,
+    const BatchInfoMap &batchInfoMap, IndexedMeshes &meshes)
+{
+  const float *positions = meshConsolidator.getVertexPositionDataPtr();
+  const float *normals = meshConsolidator.getVertexNormalDataPtr();
+  const float *uvs = meshConsolidator.getVertexUVDataPtr();
+  const float *tangents = meshConsolidator.getVertexTangentDataPtr();
+
+  meshes.vertices.clear();
+  meshes.indices.clear();
+  meshes.batches.clear();
+
+  // Go by name so the layout does not depend on hash order.
+  map<string, BatchInfo> sorted(batchInfoMap.begin(), batchInfoMap.end());
+  unordered_map<MeshVertex, uint32_t, VertexHash, VertexEqual> welded;
+  for (auto it = sorted.begin(); it != sorted.end(); it++) {
+    const BatchInfo &info = it->second;
+    MeshBatch batch;
+    batch.firstIndex = meshes.indices.size();
+    batch.numIndices = info.numIndices;
+    batch.centroid = info.centroid;
+
+    // Only weld within a mesh, so each mesh's vertices stay together.
+    welded.clear();
+    size_t firstVertex = meshes.vertices.size();
+    batch.firstVertex = firstVertex;
+    for (size_t i = info.startIndex; i < info.startIndex + info.numIndices; i++) {
+      MeshVertex v;
+      v.position = vec3(positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2]);
+      v.normal = vec3(normals[i * 3], normals[i * 3 + 1], normals[i * 3 + 2]);
+      v.uv = vec2(uvs[i * 2], uvs[i * 2 + 1]);
+      v.tangent = vec3(tangents[i * 3], tangents[i * 3 + 1], tangents[i * 3 + 2]);
+
+      auto found = welded.insert(make_pair(v, (uint32_t)meshes.vertices.size()));
+      if (found.second) meshes.vertices.push_back(v);
+      meshes.indices.push_back(found.first->second);
+    }
+    batch.numVertices = meshes.vertices.size() - firstVertex;
+    batch.positionScale = vec3(1.0f);
+    batch.positionBias = vec3(0.0f);
+    meshes.batches[it->first] = batch;
+  }
+}
+
+//---------------------------------------------------------------------------------------
+namespace {
+  struct QuantizedVertex {
+    uint16_t position[4]; // w unused
+    uint32_t normal;
+    uint32_t tangent;
+    uint32_t uv;
+  };
+
+  struct FloatPositionVertex {
+    float position[3];
+    uint32_t normal;
+    uint32_t tangent;
+    uint32_t uv;
+  };
+
+  static_assert(sizeof(QuantizedVertex) == 20, "QuantizedVertex must not be padded");
+  static_assert(sizeof(FloatPositionVertex) == 24, "FloatPositionVertex must not be padded");
+
+  // Signed normalised 10:10:10:2, x in the low bits; w is left 0.
+  uint32_t packSnorm1010102(const vec3 &v) {
+    uint32_t packed = 0;
+    for (int i = 0; i < 3; i++) {
+      float c = std::min(std::max(v[i], -1.0f), 1.0f);
+      int32_t q = (int32_t)std::round(c * 511.0f);
+      packed |= ((uint32_t)q & 0x3ff) << (10 * i);
+    }
+    return packed;
+  }
+
+  template <typename PackedVertex>
+  void packAttributes(const MeshVertex &v, PackedVertex &out) {
+    out.normal = packSnorm1010102(v.normal);
+    out.tangent = packSnorm1010102(v.tangent);
+    out.uv = packHalf2x16(v.uv);
+  }
+}
+
+void packVertices(IndexedMeshes &meshes, bool quantizePositions, PackedVertices &packed) {
+  VertexLayout &layout = packed.layout;
+  if (quantizePositions) {
+    layout.stride = sizeof(QuantizedVertex);
+    layout.positionType = GL_UNSIGNED_SHORT;
+    layout.positionOffset = offsetof(QuantizedVertex, position);
+    layout.normalOffset = offsetof(QuantizedVertex, normal);
+    layout.tangentOffset = offsetof(QuantizedVertex, tangent);
+    layout.uvOffset = offsetof(QuantizedVertex, uv);
+  } else {
+    layout.stride = sizeof(FloatPositionVertex);
+    layout.positionType = GL_FLOAT;
+    layout.positionOffset = offsetof(FloatPositionVertex, position);
+    layout.normalOffset = offsetof(FloatPositionVertex, normal);
+    layout.tangentOffset = offsetof(FloatPositionVertex, tangent);
+    layout.uvOffset = offsetof(FloatPositionVertex, uv);
+  }
+  packed.data.resize(meshes.vertices.size() * layout.stride);
+
+  if (!quantizePositions) {
+    FloatPositionVertex *out = (FloatPositionVertex *)packed.data.data();
+    for (size_t i = 0; i < meshes.vertices.size(); i++) {
+      const MeshVertex &v = meshes.vertices[i];
+      memcpy(out[i].position, &v.position, sizeof(out[i].position));
+      packAttributes(v, out[i]);
+    }
+    return;
+  }
+
+  QuantizedVertex *out = (QuantizedVertex *)packed.data.data();
+  for (auto it = meshes.batches.begin(); it != meshes.batches.end(); it++) {
+    MeshBatch &batch = it->second;
+    vec3 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+    for (size_t i = batch.firstVertex; i < batch.firstVertex + batch.numVertices; i++) {
+      lo = min(lo, meshes.vertices[i].position);
+      hi = max(hi, meshes.vertices[i].position);
+    }
+    batch.positionBias = lo;
+    batch.positionScale = hi - lo;
+    for (int c = 0; c < 3; c++) {
+      if (batch.positionScale[c] <= 0.0f) batch.positionScale[c] = 1.0f;
+    }
+
+    for (size_t i = batch.firstVertex; i < batch.firstVertex + batch.numVertices; i++) {
+      const MeshVertex &v = meshes.vertices[i];
+      vec3 t = (v.position - batch.positionBias) / batch.positionScale;
+      for (int c = 0; c < 3; c++) {
+        out[i].position[c] = (uint16_t)std::round(std::min(std::max(t[c], 0.0f), 1.0f) * 65535.0f);
+      }
+      out[i].position[3] = 0;
+      packAttributes(v, out[i]);
+    }
+  }
+}
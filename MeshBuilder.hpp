@@ -0,0 +1,72 @@
+#pragma once
+
+#include "cs488-framework/OpenGLImport.hpp"
+#include "cs488-framework/MeshConsolidator.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// One vertex of the consolidated scene meshes, all attributes interleaved.
+struct MeshVertex {
+  glm::vec3 position;
+  glm::vec3 normal;
+  glm::vec2 uv;
+  glm::vec3 tangent;
+};
+
+static_assert(sizeof(MeshVertex) == 11 * sizeof(float), "MeshVertex must not be padded");
+
+// A mesh's range of the index buffer. Indices refer to absolute vertices.
+struct MeshBatch {
+  unsigned int firstIndex;
+  unsigned int numIndices;
+  unsigned int firstVertex;
+  unsigned int numVertices;
+  glm::vec3 centroid;
+  // Model space position = stored position * positionScale + positionBias.
+  glm::vec3 positionScale;
+  glm::vec3 positionBias;
+};
+
+// Every mesh of a MeshConsolidator with duplicate vertices welded, as one
+// interleaved vertex array and one index array.
+struct IndexedMeshes {
+  std::vector<MeshVertex> vertices;
+  std::vector<uint32_t> indices;
+  std::map<std::string, MeshBatch> batches; // by mesh id
+
+  // GL_UNSIGNED_SHORT if every index fits in 16 bits, else GL_UNSIGNED_INT.
+  GLenum indexType() const;
+  size_t indexSize() const;
+  // Index data in indexType().
+  std::vector<char> packedIndices() const;
+};
+
+// Weld bitwise identical vertices within each mesh of batchInfoMap.
+void buildIndexedMeshes(const MeshConsolidator &meshConsolidator,
+    const BatchInfoMap &batchInfoMap, IndexedMeshes &meshes);
+
+// Attribute formats of a packed vertex buffer. Normals and tangents are signed
+// normalised GL_INT_2_10_10_10_REV and UVs GL_HALF_FLOAT. Positions are either
+// GL_FLOAT or GL_UNSIGNED_SHORT normalised to the mesh's bounds.
+struct VertexLayout {
+  GLsizei stride;
+  GLenum positionType;
+  size_t positionOffset;
+  size_t normalOffset;
+  size_t tangentOffset;
+  size_t uvOffset;
+};
+
+struct PackedVertices {
+  std::vector<char> data;
+  VertexLayout layout;
+};
+
+// Compress meshes.vertices into 20 byte (quantised positions) or 24 byte
+// vertices, down from 44. Sets each batch's positionScale and positionBias.
+void packVertices(IndexedMeshes &meshes, bool quantizePositions, PackedVertices &packed);
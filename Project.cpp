@@ -1,16 +1,20 @@
 #include "debug.hpp"
 #include "Project.hpp"
 #include "scene_lua.hpp"
+#include "SceneSnapshot.hpp"
 using namespace std;
 
 #include "cs488-framework/GlErrorCheck.hpp"
 #include "cs488-framework/MathUtils.hpp"
+#include "cs488-framework/ShaderException.hpp"
 #include "GeometryNode.hpp"
 #include "JointNode.hpp"
 #include "PerlinNoise.hpp"
 
 #include "stb_image.h"
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 
 #include <imgui/imgui.h>
 
@@ -18,9 +22,11 @@ using namespace std;
 #include <glm/gtx/io.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/vector_angle.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <fstream>
 
 #include <set>
+#include <sstream>
 #include <string>
 
 using namespace glm;
@@ -29,11 +35,30 @@ using namespace glm;
 
 static const string LEVELFILE = "level.txt";
 static bool show_gui = true;
-static const string HIDDEN = "~hidden";
+static const string PERLIN_TEXTURE = "~perlin";
 static const float SPHERE_RAD = 0.5;
+static const float NEAR_PLANE = 0.1, FAR_PLANE = 100;
+// Store mesh positions as 16 bit fractions of each mesh's bounds.
+static const bool QUANTIZE_POSITIONS = true;
 static const size_t CIRCLE_PTS = 48;
 static const size_t SHADOW_DIM = 1024;
 static const size_t SHADOW_WIDTH = SHADOW_DIM, SHADOW_HEIGHT = SHADOW_DIM;
+// The light moves once every LIGHT_FRAME_STEP frames, so the cached static
+// shadow map survives that long.
+static const int LIGHT_FRAME_STEP = 6;
+// The blur history is kept at 1/POST_SCALE of the window size (1, 2 or 4).
+static const int POST_SCALE = 2;
+// Where the Export Timings button writes FrameProfiler's statistics.
+static const string TIMINGS_FILE = "frame-timings.csv";
+// Uniform blocks inserted into every shader, see createShader().
+static const string SHADER_PRELUDE = "UniformBlocks.glsl";
+// Point lights: a dim glow around every bubble and a bright flash that fades
+// over POP_FLASH_FRAMES where one pops.
+static const float GLOW_RADIUS = 1.5f;
+static const float GLOW_INTENSITY = 0.25f;
+static const float POP_FLASH_RADIUS = 4.0f;
+static const float POP_FLASH_INTENSITY = 2.0f;
+static const int POP_FLASH_FRAMES = 30;
 static const vec3 CANNON_POS(0,-6,0);
 
 static const float ROT_SPEED = 1;
@@ -58,7 +83,7 @@ static const size_t MIN_GROUPSIZE = 3;
 static vector<vector<BubbleNode *>> bubbleGrid;
 
 static vector<SceneNode *> bubbleTypes;
-static vector<vec3> btRot;
+static vector<vec3> btRot; // degrees per frame
 
 #include <cstdlib>
 #include <ctime>
@@ -75,16 +100,48 @@ static bool cycleTypes = false;
 // Constructor
 Project::Project(const std::string & luaSceneFile)
 	: m_luaSceneFile(luaSceneFile),
+	  m_rootNode(nullptr),
+	  m_newBubble(nullptr),
 	  m_positionAttribLocation(0),
 	  m_normalAttribLocation(0),
 	  m_uvAttribLocation(0),
 	  m_tangentAttribLocation(0),
 	  m_vao_meshData(0),
+    m_fbo_lastScreen(0),
+    m_lastScreen(0),
+    m_rbo_lastScreenDepth(0),
+    m_fbo_history(),
+    m_history(),
+    m_historyIndex(0),
+    m_historyValid(false),
+    m_postScale(POST_SCALE),
+    m_postWidth(0),
+    m_postHeight(0),
+    m_fbo_oit(0),
+    m_oitAccum(0),
+    m_oitWeight(0),
+    m_weightedPassLocation(-1),
     m_vao_screen(0),
-	  m_vbo_vertexPositions(0),
-	  m_vbo_vertexNormals(0),
-	  m_vbo_vertexUVs(0),
-	  m_vbo_vertexTangents(0),
+    m_headless(false),
+    m_fbo_output(0),
+    m_outputTexture(0),
+	  m_vbo_vertices(0),
+	  m_ibo_indices(0),
+	  m_indexType(GL_UNSIGNED_INT),
+	  m_indexSize(sizeof(uint32_t)),
+	  m_shadowDrawCalls(0),
+	  m_opaqueDrawCalls(0),
+	  m_instanceOffset(0),
+	  m_staticShadowInstances(0),
+	  m_dynamicShadowInstances(0),
+	  m_staticShadowKey(0),
+	  m_cachedStaticShadowKey(0),
+	  m_staticShadowValid(false),
+	  m_staticShadowRenders(0),
+	  m_opaqueInstances(0),
+	  m_transparentInstances(0),
+	  m_uiInstances(0),
+	  m_transparentSortMicros(0),
     m_soundManager(3),
     m_cannonAngle(90),
     m_frame(0),
@@ -94,7 +151,12 @@ Project::Project(const std::string & luaSceneFile)
      m_show_shadows(1),
      m_show_blur(1),
     m_show_transparent(1),
-   m_noiseTexture(0)
+    m_weighted_transparency(0),
+    m_show_point_lights(1),
+   m_noiseTexture(0),
+    m_ubo_frame(0),
+    m_ubo_materials(0),
+    m_ubo_meshes(0)
 {
   srand(time(NULL));
   GRID_YOFFSET = SPHERE_RAD * glm::sqrt(3);
@@ -124,7 +186,7 @@ Project::~Project()
   // TODO
   delete m_shader;
   delete m_depthMapShader;
-  delete m_rootNode;
+  unloadScene();
 }
 
 //----------------------------------------------------------------------------------------
@@ -141,7 +203,27 @@ void Project::init()
   createShader(*m_shader, "VertexShader.vs", "FragmentShader.fs");
   createShader(*m_depthMapShader, "DepthMapVertexShader.vs", "DepthMapFragmentShader.fs");
   createShader(m_screenShader, "DrawScreen.vs", "DrawScreen.fs");
+  createShader(m_oitCompositeShader, "DrawScreen.vs", "OitComposite.fs");
   createShader(m_skyboxShader, "DrawSkybox.vs", "DrawSkybox.fs");
+  cacheUniformLocations();
+
+  glGenBuffers(1, &m_ubo_frame);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_frame);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, m_ubo_frame);
+
+  glGenBuffers(1, &m_ubo_materials);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_materials);
+  glBufferData(GL_UNIFORM_BUFFER, MAX_MATERIALS * sizeof(MaterialData), nullptr, GL_STATIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, MATERIALS_BINDING, m_ubo_materials);
+
+  glGenBuffers(1, &m_ubo_meshes);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_meshes);
+  glBufferData(GL_UNIFORM_BUFFER, MAX_MESHES * sizeof(MeshData), nullptr, GL_STATIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, MESHES_BINDING, m_ubo_meshes);
 
 	glGenVertexArrays(1, &m_vao_meshData);
 	glGenVertexArrays(1, &m_vao_screen);
@@ -168,17 +250,29 @@ void Project::init()
 
 	// Acquire the BatchInfoMap from the MeshConsolidator.
 	meshConsolidator->getBatchInfoMap(m_batchInfoMap);
+  computeMeshBounds(*meshConsolidator);
 
-	// Take all vertex data within the MeshConsolidator and upload it to VBOs on the GPU.
-	uploadVertexDataToVbos(*meshConsolidator);
+  // Weld the consolidated triangle soup into indexed, interleaved meshes.
+  IndexedMeshes indexedMeshes;
+  buildIndexedMeshes(*meshConsolidator, m_batchInfoMap, indexedMeshes);
+  PackedVertices packedVertices;
+  packVertices(indexedMeshes, QUANTIZE_POSITIONS, packedVertices);
+  m_meshBatchMap = indexedMeshes.batches;
+  m_vertexLayout = packedVertices.layout;
+  DEBUGM(cout << "Meshes: " << indexedMeshes.indices.size() << " vertices welded to "
+       << indexedMeshes.vertices.size() << ", " << packedVertices.data.size() / 1024 << " KB" << endl);
+
+	// Upload the vertex and index data to the GPU.
+	uploadVertexDataToVbos(indexedMeshes, packedVertices);
 
   CHECK_GL_ERRORS;
   mapVboDataToVertexShaderInputLocations();
 
   setTextureMaps();
 
-  initBlurFBO();
-  initDepthMapFBO();
+  initPostTargets();
+  initDepthMapFBO(&m_fbo_depthMap, &m_depthMap);
+  initDepthMapFBO(&m_fbo_staticDepthMap, &m_staticDepthMap);
 
 
 	initPerspectiveMatrix();
@@ -190,14 +284,18 @@ void Project::init()
 
   loadTextures();
   loadNoiseTexture();
+  resolveRenderHandles();
 
   initGameLogic();
 
-  m_soundManager.init();
-  bgSoundId = m_soundManager.playBackground("background");
+  // Headless runs are for build servers, which have no audio device.
+  if (!m_headless) {
+    m_soundManager.init();
+    bgSoundId = m_soundManager.playBackground("background");
+  }
 }
 
-void Project::initWindowFBO(GLuint *fbo, GLuint *tex) {
+void Project::initWindowFBO(GLuint *fbo, GLuint *tex, int width, int height, GLint filter) {
   glGenFramebuffers(1,fbo);
   glGenTextures(1,tex);
 
@@ -205,10 +303,12 @@ void Project::initWindowFBO(GLuint *fbo, GLuint *tex) {
 
   glBindTexture(GL_TEXTURE_2D, *tex);
 
-  glTexImage2D(GL_TEXTURE_2D, 0,GL_RGBA, m_windowWidth, m_windowHeight, 0,GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  glTexImage2D(GL_TEXTURE_2D, 0,GL_RGBA, width, height, 0,GL_RGBA, GL_UNSIGNED_BYTE, 0);
 
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   CHECK_GL_ERRORS;
   
   glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, *tex, 0);
@@ -255,33 +355,74 @@ void Project::initSkybox() {
 
 }
 
-void Project::initBlurFBO() {
-  initWindowFBO(&m_fbo_blurredScreen, &m_blurredScreen);
-  {
-  CHECK_GL_ERRORS;
-  GLuint depthrenderbuffer;
+// Window sized targets; rebuilt whenever the window or m_postScale changes.
+void Project::initPostTargets() {
+  destroyPostTargets();
+
+  // The scene target is sampled with linear filtering when it is reduced into
+  // the history.
+  initWindowFBO(&m_fbo_lastScreen, &m_lastScreen, m_windowWidth, m_windowHeight, GL_LINEAR);
+  glGenRenderbuffers(1, &m_rbo_lastScreenDepth);
+  glBindRenderbuffer(GL_RENDERBUFFER, m_rbo_lastScreenDepth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, m_windowWidth, m_windowHeight);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_rbo_lastScreenDepth); 
   CHECK_GL_ERRORS;
-  glGenRenderbuffers(1, &depthrenderbuffer);
+
+  // Accumulation targets for weighted transparency, depth tested against the
+  // scene's depth buffer.
+  glGenFramebuffers(1, &m_fbo_oit);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_oit);
+  GLuint *oitTextures[2] = {&m_oitAccum, &m_oitWeight};
+  GLint oitFormats[2] = {GL_RGBA16F, GL_R16F};
+  for (int i = 0; i < 2; i++) {
+    glGenTextures(1, oitTextures[i]);
+    glBindTexture(GL_TEXTURE_2D, *oitTextures[i]);
+    glTexImage2D(GL_TEXTURE_2D, 0, oitFormats[i], m_windowWidth, m_windowHeight, 0, GL_RGBA, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, *oitTextures[i], 0);
+  }
+  GLenum oitDrawBuffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+  glDrawBuffers(2, oitDrawBuffers);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_rbo_lastScreenDepth);
   CHECK_GL_ERRORS;
-  glBindRenderbuffer(GL_RENDERBUFFER, depthrenderbuffer);
-  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, m_windowWidth, m_windowHeight);
 
-  initWindowFBO(&m_fbo_lastScreen, &m_lastScreen);
+  m_postWidth = glm::max(1, m_windowWidth / m_postScale);
+  m_postHeight = glm::max(1, m_windowHeight / m_postScale);
+  for (int i = 0; i < 2; i++) {
+    initWindowFBO(&m_fbo_history[i], &m_history[i], m_postWidth, m_postHeight, GL_LINEAR);
+  }
+  m_historyIndex = 0;
+  m_historyValid = false;
 
-  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthrenderbuffer); 
-  
   CHECK_GL_ERRORS;
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
   glBindRenderbuffer(GL_RENDERBUFFER,0);
   glBindTexture(GL_TEXTURE_2D,0);
+}
+
+void Project::destroyPostTargets() {
+  if (m_fbo_lastScreen) {
+    glDeleteFramebuffers(1, &m_fbo_lastScreen);
+    glDeleteTextures(1, &m_lastScreen);
+    glDeleteRenderbuffers(1, &m_rbo_lastScreenDepth);
+    glDeleteFramebuffers(2, m_fbo_history);
+    glDeleteTextures(2, m_history);
+    glDeleteFramebuffers(1, &m_fbo_oit);
+    glDeleteTextures(1, &m_oitAccum);
+    glDeleteTextures(1, &m_oitWeight);
   }
+  m_fbo_lastScreen = m_lastScreen = m_rbo_lastScreenDepth = 0;
+  m_fbo_oit = m_oitAccum = m_oitWeight = 0;
+  m_fbo_history[0] = m_fbo_history[1] = 0;
+  m_history[0] = m_history[1] = 0;
 }
 
-void Project::initDepthMapFBO() {
-  glGenFramebuffers(1, &m_fbo_depthMap);
+void Project::initDepthMapFBO(GLuint *fbo, GLuint *depthMap) {
+  glGenFramebuffers(1, fbo);
 
-  glGenTextures(1, &m_depthMap);
-  glBindTexture(GL_TEXTURE_2D, m_depthMap);
+  glGenTextures(1, depthMap);
+  glBindTexture(GL_TEXTURE_2D, *depthMap);
   glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 
              SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -290,8 +431,8 @@ void Project::initDepthMapFBO() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);  
   float borderColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
   glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
-  glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_depthMap);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_depthMap, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, *depthMap, 0);
   glDrawBuffer(GL_NONE);
   glReadBuffer(GL_NONE);
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -342,17 +483,17 @@ void Project::loadTexture(const string &texture, char *defaultData) {
   }
 }
 
-void Project::loadTexturesFromList(set<string> &textures, map<string, GLuint> &nameMap, std::vector<GLuint> texs, char *defaultData) {
+void Project::loadTexturesFromList(set<string> &textures, map<string, int> &nameMap, std::vector<GLuint> &texs, char *defaultData) {
   DEBUGM(cerr << "generating " << textures.size() << " textures" << endl);
   texs.resize(textures.size());
   glGenTextures(textures.size(), texs.data());
   int texId = 0;
   for (set<string>::iterator it = textures.begin(); it != textures.end(); it++, texId++) {
     const string &texture = *it;
-    if (texture[0] == '~') continue;
+    nameMap[texture] = texId;
+    if (texture[0] == '~') continue; // generated textures are filled in elsewhere
     glBindTexture(GL_TEXTURE_2D, texs[texId]);
     loadTexture(texture, defaultData);
-    nameMap[texture] = texs[texId];
 
     CHECK_GL_ERRORS; // we might run out of space
     glBindTexture(GL_TEXTURE_2D,0);
@@ -360,17 +501,11 @@ void Project::loadTexturesFromList(set<string> &textures, map<string, GLuint> &n
 }
 
 void Project::loadTextures() {
-  vector<SceneNode *> nodes;
-  m_rootNode->getNodes(nodes);
-
   set<string> textures;
   set<string> bumpMaps;
-  for (vector<SceneNode *>::iterator it = nodes.begin(); it != nodes.end(); it++) {
-    if ((*it)->m_nodeType == NodeType::GeometryNode) {
-      GeometryNode *node = dynamic_cast<GeometryNode *>(*it);
-      textures.insert(node->texture);
-      bumpMaps.insert(node->bumpMap);
-    }
+  for (GeometryNode *node : m_sceneIndex.geometryNodes()) {
+    textures.insert(node->texture);
+    bumpMaps.insert(node->bumpMap);
   }
   
   unsigned char defaultTex[] = {255,255,255};
@@ -380,6 +515,146 @@ void Project::loadTextures() {
   loadTexturesFromList(bumpMaps, m_bumpNameIdMap, m_bumps, (char*)defaultBump);
 }
 
+// Resolve every GeometryNode's mesh, texture and bump map names to dense handles
+// so the render loop only indexes plain arrays. Must run after the meshes,
+// textures and noise texture are loaded.
+void Project::resolveRenderHandles() {
+  m_meshBatches.clear();
+  m_meshBounds.clear();
+  m_meshNameIdMap.clear();
+  for (auto it = m_meshBatchMap.begin(); it != m_meshBatchMap.end(); it++) {
+    m_meshNameIdMap[it->first] = m_meshBatches.size();
+    m_meshBatches.push_back(it->second);
+    m_meshBounds.push_back(m_meshBoundsMap[it->first]);
+  }
+  uploadMeshTable();
+
+  // The noise texture is regenerated in place, so its id stays valid.
+  auto perlin = m_textureNameIdMap.find(PERLIN_TEXTURE);
+  if (perlin != m_textureNameIdMap.end()) {
+    glDeleteTextures(1, &m_textures[perlin->second]);
+    m_textures[perlin->second] = m_noiseTexture;
+  }
+
+  for (GeometryNode *node : m_sceneIndex.geometryNodes()) {
+    auto mesh = m_meshNameIdMap.find(node->meshId);
+    if (mesh == m_meshNameIdMap.end()) {
+      cerr << "Unknown mesh " << node->meshId << " for node " << node->m_name << endl;
+      node->meshHandle = -1;
+    } else if (mesh->second >= MAX_MESHES) {
+      // Past the end of the Meshes block.
+      cerr << "More than " << MAX_MESHES << " meshes, not drawing node " << node->m_name << endl;
+      node->meshHandle = -1;
+    } else {
+      node->meshHandle = mesh->second;
+    }
+    node->textureHandle = m_textureNameIdMap.at(node->texture);
+    node->bumpHandle = m_bumpNameIdMap.at(node->bumpMap);
+  }
+
+  // Share one RenderMaterial between nodes with the same settings.
+  m_materials.clear();
+  for (GeometryNode *node : m_sceneIndex.geometryNodes()) {
+    const Material &m = node->material;
+    node->materialHandle = -1;
+    for (size_t i = 0; i < m_materials.size(); i++) {
+      const RenderMaterial &other = m_materials[i];
+      if (other.textureHandle == node->textureHandle && other.bumpHandle == node->bumpHandle &&
+          other.material.kd == m.kd && other.material.ks == m.ks &&
+          other.material.shininess == m.shininess && other.material.transparency == m.transparency) {
+        node->materialHandle = i;
+        break;
+      }
+    }
+    if (node->materialHandle < 0 && m_materials.size() == (size_t)MAX_MATERIALS) {
+      // Past the end of the Materials block; leave the node undrawn.
+      cerr << "More than " << MAX_MATERIALS << " materials, not drawing node " << node->m_name << endl;
+      node->meshHandle = -1;
+    } else if (node->materialHandle < 0) {
+      node->materialHandle = m_materials.size();
+      m_materials.push_back(RenderMaterial{m, node->textureHandle, node->bumpHandle});
+    }
+  }
+  uploadMaterialTable();
+}
+
+// Copy each mesh's position scale and bias into the Meshes uniform block,
+// indexed by mesh handle.
+void Project::uploadMeshTable() {
+  // resolveRenderHandles() gives no node a handle past the block.
+  vector<MeshData> table(std::min(m_meshBatches.size(), (size_t)MAX_MESHES));
+  for (size_t i = 0; i < table.size(); i++) {
+    table[i].positionScale = vec4(m_meshBatches[i].positionScale, 0.0f);
+    table[i].positionBias = vec4(m_meshBatches[i].positionBias, 0.0f);
+  }
+  glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_meshes);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, table.size() * sizeof(MeshData), table.data());
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  CHECK_GL_ERRORS;
+}
+
+// Copy m_materials into the Materials uniform block, indexed by the
+// per-instance material handle.
+void Project::uploadMaterialTable() {
+  assert(m_materials.size() <= (size_t)MAX_MATERIALS);
+  vector<MaterialData> table(m_materials.size());
+  for (size_t i = 0; i < table.size(); i++) {
+    const Material &m = m_materials[i].material;
+    table[i] = MaterialData{m.kd, m.shininess, m.ks, m.transparency};
+  }
+  glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_materials);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, table.size() * sizeof(MaterialData), table.data());
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  CHECK_GL_ERRORS;
+}
+
+// Model space bounds of each consolidated mesh, from its vertex positions.
+void Project::computeMeshBounds(const MeshConsolidator &meshConsolidator) {
+  const float *positions = meshConsolidator.getVertexPositionDataPtr();
+  m_meshBoundsMap.clear();
+  for (auto it = m_batchInfoMap.begin(); it != m_batchInfoMap.end(); it++) {
+    const BatchInfo &batch = it->second;
+    Aabb &box = m_meshBoundsMap[it->first];
+    for (size_t v = batch.startIndex; v < batch.startIndex + batch.numIndices; v++) {
+      box.expand(vec3(positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2]));
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------
+// Free the loaded scene. Bubbles are created at run time outside the arena and
+// hang off its nodes, so they go first; then the whole import is released at
+// once.
+void Project::unloadScene() {
+  for (size_t i = 0; i < bubbleGrid.size(); i++) {
+    for (size_t j = 0; j < bubbleGrid[i].size(); j++) {
+      if (bubbleGrid[i][j]) removeBubble(i, j);
+    }
+  }
+  if (m_newBubble) {
+    destroyBubble(m_newBubble);
+    m_newBubble = nullptr;
+  }
+
+  // Drop everything that points into the scene.
+  m_animator.clear();
+  m_sceneIndex.clear();
+  m_drawItems.clear();
+  m_bvhNodes.clear();
+  m_popFlashes.clear();
+  m_staticShadowQueue.clear();
+  m_dynamicShadowQueue.clear();
+  m_opaqueQueue.clear();
+  m_transparentQueue.clear();
+  m_uiQueue.clear();
+  m_staticShadowValid = false;
+  m_cursorHit = RayHit();
+  m_selectedHit = RayHit();
+
+  m_sceneArena.release();
+  m_rootNode = nullptr;
+}
+
 //----------------------------------------------------------------------------------------
 void Project::processLuaSceneFile(const std::string & filename) {
 	// This version of the code treats the Lua file as an Asset,
@@ -389,15 +664,15 @@ void Project::processLuaSceneFile(const std::string & filename) {
 	// m_rootNode = std::shared_ptr<SceneNode>(import_lua(assetFilePath));
 
 	// This version of the code treats the main program argument
-	// as a straightforward pathname.
-	m_rootNode = import_lua(filename);
+	// as a straightforward pathname. A binary snapshot of the scene is used
+	// instead of running the script when it is up to date.
+	unloadScene();
+	m_rootNode = import_scene(filename, &m_sceneIndex, &m_sceneArena);
 	if (!m_rootNode) {
 		std::cerr << "Could not open " << filename << std::endl;
 	}
   
-  vector<SceneNode *> nodes;
-  m_rootNode->getNodes(nodes);
-  hookControls(nodes);
+  hookControls(m_sceneIndex);
 }
 
 
@@ -405,30 +680,46 @@ vec3 getPosFromGrid(int i, int j) {
   return vec3(- i * SPHERE_RAD * 2 - SPHERE_RAD * (j % 2) + XBOARDCORNER, - j * GRID_YOFFSET + boardTop - SPHERE_RAD, 0);
 }
 
-void Project::hookControls(vector<SceneNode *> &nodes) {
-  
-  for (vector<SceneNode *>::iterator it = nodes.begin(); it != nodes.end(); it++) {
-    SceneNode * node = *it;
-    GeometryNode *gnode = dynamic_cast<GeometryNode *>(*it);
-    if (gnode) {
-      if (gnode->m_name == "~topWall") {
-        m_topWall = gnode;
-      }  
-    } else if (node->m_name == "~cannon") {
-      m_cannonNode = node;
-    } else if (node->m_name == "~bubblesHolder") {
-      m_bubblesHolder = node;
-    }
-    for (int i = 0; i < NUM_BUBBLETYPES; i++) {
-      if (node->m_name == "~bubble" + std::to_string(i+1)) bubbleTypes[i] = node;
-    }
+// Depth first search for the chain of nodes from root down to target.
+static bool findPath(SceneNode *root, const SceneNode *target, vector<SceneNode *> &path) {
+  path.push_back(root);
+  if (root == target) return true;
+  for (SceneNode *child : root->children) {
+    if (findPath(child, target, path)) return true;
+  }
+  path.pop_back();
+  return false;
+}
+
+// First GeometryNode at or under node, depth first.
+static const GeometryNode * findGeometry(const SceneNode *node) {
+  if (node->m_nodeType == NodeType::GeometryNode) return static_cast<const GeometryNode *>(node);
+  for (const SceneNode *child : node->children) {
+    if (const GeometryNode *geometry = findGeometry(child)) return geometry;
+  }
+  return nullptr;
+}
+
+void Project::hookControls(const SceneIndex &index) {
+  m_topWall = index.findGeometry("~topWall");
+  m_cannonNode = index.findNode("~cannon");
+  m_bubblesHolder = index.findNode("~bubblesHolder");
+  m_bubblesHolderPath.clear();
+  if (!m_bubblesHolder || !findPath(m_rootNode, m_bubblesHolder, m_bubblesHolderPath)) {
+    assert(0);
   }
 
+  m_bubbleGlowColours.assign(NUM_BUBBLETYPES, vec3(1.0f));
   for (int i = 0; i < NUM_BUBBLETYPES; i++) {
+    bubbleTypes[i] = index.findNode("~bubble" + std::to_string(i+1));
     if (bubbleTypes[i] == nullptr) {
       cerr << i << endl;
       assert(0);
     }
+    // Bubbles glow in the diffuse colour of their first piece of geometry.
+    if (const GeometryNode *geometry = findGeometry(bubbleTypes[i])) {
+      m_bubbleGlowColours[i] = geometry->material.kd;
+    }
   }
 }
 
@@ -444,8 +735,27 @@ void getNearestGrid(vec3 pos, int &i, int &j) {
 }
 
 
+void Project::initAnimations() {
+  // Each bubble type turns by btRot about world x, then y, then z every frame.
+  // That step is one fixed rotation, so repeating it spins the type about a
+  // single axis; a full turn is one loop of the track, so it repeats seamlessly.
+  AnimationClip spin;
+  for (int i = 0; i < bubbleTypes.size(); i++) {
+    quat step = glm::angleAxis(degreesToRadians(btRot[i].z), vec3(0, 0, 1)) *
+      glm::angleAxis(degreesToRadians(btRot[i].y), vec3(0, 1, 0)) *
+      glm::angleAxis(degreesToRadians(btRot[i].x), vec3(1, 0, 0));
+    float rate = glm::degrees(glm::angle(step));
+    if (rate == 0) continue;
+    m_animator.setSpinAxis(bubbleTypes[i], glm::axis(step));
+    spin.addKey(bubbleTypes[i], AnimChannel::Spin, 0, 0);
+    spin.addKey(bubbleTypes[i], AnimChannel::Spin, 360 / rate, 360);
+  }
+  m_animator.play(spin);
+}
+
 void Project::initGameLogic() {
-  m_topWall->setPos(vec3(0,boardTop,0));
+  m_animator.setChannel(m_topWall, AnimChannel::TranslateY, boardTop);
+  initAnimations();
 
   /*for (int i = 0; i < GRID_WIDTH;i++) {
     for (int j = 0; j < gridHeight; j++) {
@@ -453,7 +763,7 @@ void Project::initGameLogic() {
 
       GeometryNode *newBubble = new GeometryNode("sphere", "bubble");
       newBubble->scale(vec3(SPHERE_RAD));
-      newBubble->setPos(pos);
+      newBubble->translate(pos);
       m_bubblesHolder->add_child(newBubble);
     }
   }*/
@@ -469,58 +779,231 @@ void Project::bubbleOffGrid() {
 void Project::lowerTop() {
   gridHeight-=1;
   boardTop -= GRID_YOFFSET;
-  m_topWall->setPos(vec3(0,boardTop,0));
+  m_animator.setChannel(m_topWall, AnimChannel::TranslateY, boardTop);
   for (int i = 0; i < GRID_WIDTH;i++) {
     for (int j = 0; j < START_GRID_HEIGHT; j++) {
       if (bubbleGrid[i][j]) {
-        bubbleGrid[i][j]->setPos(getPosFromGrid(i, j));
+        m_components.transforms.get(bubbleGrid[i][j]->m_entity).position = getPosFromGrid(i, j);
         if (j >= gridHeight) bubbleOffGrid();
       }
     }
   }
 }
 
+BubbleNode * Project::spawnBubble(const vec3 &pos, size_t type) {
+  EntityId id = m_components.create();
+  BubbleNode *newBubble = new BubbleNode("bubble", m_components, id);
+  m_components.addBody(id, TransformComponent(pos), PhysicsBody(vec3(0), SPHERE_RAD));
+  m_components.colours.add(id, BubbleColour(type));
+  m_components.renderables.add(id, RenderableComponent(newBubble));
+
+  newBubble->add_child(bubbleTypes[type]);
+  m_bubblesHolder->add_child(newBubble);
+  return newBubble;
+}
+
+void Project::destroyBubble(BubbleNode *bubble) {
+  // Its id is handed out again by the next spawn, so hits on it must go now.
+  if (m_cursorHit.bubble == bubble->m_entity) m_cursorHit = RayHit();
+  if (m_selectedHit.bubble == bubble->m_entity) m_selectedHit = RayHit();
+  m_bubblesHolder->remove_child(bubble);
+  m_components.destroy(bubble->m_entity);
+  bubble->children.clear(); // the bubble type is shared
+  delete bubble;
+}
+
 void Project::readyBubble() {
   static size_t bt = 0;
-  BubbleNode*newBubble = new BubbleNode("bubble");
-  newBubble->collisionRadius= SPHERE_RAD;
   if (cycleTypes)
     bt = (bt + 1) % NUM_BUBBLETYPES;
   else
     bt = rand() % NUM_BUBBLETYPES;
 
-  newBubble->type = bt;
-  
-  newBubble->setPos(CANNON_POS);
-  newBubble->add_child(bubbleTypes[bt]);
-
-  m_newBubble = newBubble;
-  m_bubblesHolder->add_child(newBubble);
+  m_newBubble = spawnBubble(CANNON_POS, bt);
 }
 
 void Project::shootBubble() {
   if (m_inspecting) return;
-  if (m_newBubble->moveVector == vec3(0)) {
-    m_newBubble->setMoveVector(glm::rotate(vec3(1,0,0), glm::radians(m_cannonAngle), vec3(0,0,1)) * BUBBLE_SPEED);
+  PhysicsBody &body = m_components.bodies.get(m_newBubble->m_entity);
+  if (body.velocity == vec3(0)) {
+    body.velocity = glm::rotate(vec3(1,0,0), glm::radians(m_cannonAngle), vec3(0,0,1)) * BUBBLE_SPEED;
     curTurnsUntilLower--;
   }
 }
 
 void Project::rotateCannon(int dir) {
   if (m_inspecting) return;
-  float amt = dir * ROT_SPEED;
+  setCannonAngle(m_cannonAngle + dir * ROT_SPEED);
+}
+
+void Project::setCannonAngle(float angle) {
   float pCannonAngle = m_cannonAngle;
-    m_cannonAngle = glm::clamp(m_cannonAngle + amt, 0+ROT_MAX, 180-ROT_MAX);
+  m_cannonAngle = glm::clamp(angle, 0+ROT_MAX, 180-ROT_MAX);
   if (pCannonAngle != m_cannonAngle) {
-    m_cannonNode->rotate('z', amt);
+    m_animator.setChannel(m_cannonNode, AnimChannel::RotateZ, m_cannonAngle - 90);
+  }
+}
+
+//----------------------------------------------------------------------------------------
+// World to bubble board space (where bubble positions and the grid live).
+glm::mat4 Project::bubblesHolderInverse() const {
+  mat4 inverse;
+  for (const SceneNode *node : m_bubblesHolderPath) {
+    inverse = node->get_inverse() * inverse;
+  }
+  return inverse;
+}
+
+// World space ray through the cursor, in window coordinates.
+Ray Project::cursorRay(double xPos, double yPos) const {
+  vec2 ndc(2.0f * xPos / m_windowWidth - 1.0f, 1.0f - 2.0f * yPos / m_windowHeight);
+  mat4 inverseViewProjection = glm::inverse(m_perpsective * m_view);
+  vec4 nearPoint = inverseViewProjection * vec4(ndc, -1.0f, 1.0f);
+  vec4 farPoint = inverseViewProjection * vec4(ndc, 1.0f, 1.0f);
+  vec3 origin = vec3(nearPoint) / nearPoint.w;
+  return Ray(origin, glm::normalize(vec3(farPoint) / farPoint.w - origin));
+}
+
+bool Project::raycast(const Ray &ray, RayHit &hit) const {
+  hit = RayHit();
+
+  // Into board space. The direction is not renormalised so distances along the
+  // local ray are the same as along the world ray.
+  mat4 toBoard = bubblesHolderInverse();
+  Ray boardRay(vec3(toBoard * vec4(ray.origin, 1.0f)), vec3(toBoard * vec4(ray.direction, 0.0f)));
+
+  float nearest = std::numeric_limits<float>::max();
+  float t;
+  const ComponentArray<PhysicsBody> &bodies = m_components.bodies;
+  for (size_t b = 0; b < bodies.size(); b++) {
+    EntityId id = bodies.entity(b);
+    // Where the bubble is drawn, which is off its physics position while it
+    // is being inspected.
+    vec3 center = vec3(m_components.renderables.get(id).node->get_transform()[3]);
+    if (intersectRay(boardRay, center, bodies[b].radius, t) && t < nearest) {
+      nearest = t;
+      hit.bubble = id;
+    }
+  }
+
+  if (hit.bubble != NO_ENTITY) {
+    hit.node = m_components.renderables.get(hit.bubble).node;
+    getNearestGrid(m_components.transforms.get(hit.bubble).position, hit.gridI, hit.gridJ);
+  } else {
+    m_rayLeaves.clear();
+    m_bvh.query(ray, nearest, m_rayLeaves);
+    for (size_t leaf : m_rayLeaves) {
+      if (intersectRay(ray, m_drawItems[leaf].bounds, t) && t < nearest) {
+        nearest = t;
+        hit.node = m_drawItems[leaf].node;
+      }
+    }
+    if (!hit.node) return false;
+
+    // Cell where the ray crosses the bubble plane.
+    if (boardRay.direction.z != 0) {
+      getNearestGrid(boardRay.at(-boardRay.origin.z / boardRay.direction.z), hit.gridI, hit.gridJ);
+    }
   }
+
+  hit.distance = nearest;
+  hit.point = ray.at(nearest);
+  return true;
+}
+
+// Point the cannon at where the ray crosses the bubble plane.
+void Project::aimCannonAt(const Ray &ray) {
+  mat4 toBoard = bubblesHolderInverse();
+  Ray boardRay(vec3(toBoard * vec4(ray.origin, 1.0f)), vec3(toBoard * vec4(ray.direction, 0.0f)));
+  if (boardRay.direction.z == 0) return;
+  float t = (CANNON_POS.z - boardRay.origin.z) / boardRay.direction.z;
+  if (t < 0) return;
+
+  vec3 target = boardRay.at(t) - CANNON_POS;
+  if (target.y <= 0) return;
+  setCannonAngle(glm::degrees(std::atan2(target.y, target.x)));
+}
+
+static string readShaderFile(const string &path) {
+	ifstream file(path.c_str());
+	if (!file) throw ShaderException("Unable to open shader " + path);
+	stringstream contents;
+	contents << file.rdbuf();
+	return contents.str();
+}
+
+// Compile the asset at path with prelude inserted after its #version line,
+// and attach it to program ahead of link().
+static void attachShaderSource(ShaderProgram &program, GLenum type, const string &path,
+    const string &prelude) {
+	string source = readShaderFile(path);
+	size_t afterVersion = source.find('\n', source.find("#version"));
+	if (afterVersion == string::npos) afterVersion = source.size() - 1;
+	// Keep compile errors pointing at the lines of the file itself.
+	source.insert(afterVersion + 1, prelude + "\n#line 2\n");
+
+	GLuint shader = glCreateShader(type);
+	const char *text = source.c_str();
+	glShaderSource(shader, 1, &text, nullptr);
+	glCompileShader(shader);
+	GLint compiled = GL_FALSE;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (compiled != GL_TRUE) {
+		GLchar log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+		glDeleteShader(shader);
+		throw ShaderException("Error compiling " + path + ":\n" + log);
+	}
+	glAttachShader(program.getProgramObject(), shader);
+	// Freed along with the program.
+	glDeleteShader(shader);
+	CHECK_GL_ERRORS;
 }
 
 void Project::createShader(ShaderProgram &program, const string &vs, const string &fs) {
+	// The uniform blocks matching FrameUniforms.hpp and DrawRingBuffer.hpp are
+	// declared once, in SHADER_PRELUDE.
+	const string prelude = readShaderFile(getAssetFilePath(SHADER_PRELUDE.c_str()));
 	program.generateProgramObject();
-	program.attachVertexShader( getAssetFilePath(vs.c_str()).c_str() );
-	program.attachFragmentShader( getAssetFilePath(fs.c_str()).c_str() );
+	attachShaderSource(program, GL_VERTEX_SHADER, getAssetFilePath(vs.c_str()), prelude);
+	attachShaderSource(program, GL_FRAGMENT_SHADER, getAssetFilePath(fs.c_str()), prelude);
 	program.link();
+
+	// Programs using the per-frame block all read it from the same binding.
+	GLuint blockIndex = glGetUniformBlockIndex(program.getProgramObject(), FRAME_UNIFORMS_BLOCK);
+	if (blockIndex != GL_INVALID_INDEX) {
+		glUniformBlockBinding(program.getProgramObject(), blockIndex, FRAME_UNIFORMS_BINDING);
+	}
+	blockIndex = glGetUniformBlockIndex(program.getProgramObject(), MATERIALS_BLOCK);
+	if (blockIndex != GL_INVALID_INDEX) {
+		glUniformBlockBinding(program.getProgramObject(), blockIndex, MATERIALS_BINDING);
+	}
+	blockIndex = glGetUniformBlockIndex(program.getProgramObject(), MESHES_BLOCK);
+	if (blockIndex != GL_INVALID_INDEX) {
+		glUniformBlockBinding(program.getProgramObject(), blockIndex, MESHES_BINDING);
+	}
+}
+
+// Resolve uniform locations once, after linking, and set the samplers which
+// never change.
+void Project::cacheUniformLocations() {
+  m_shader->cacheUniformLocations();
+  m_depthMapShader->cacheUniformLocations();
+
+  m_skyboxModelLocation = m_skyboxShader.getUniformLocation("model");
+
+  m_screenDoBlurLocation = m_screenShader.getUniformLocation("doBlur");
+  m_screenShader.enable();
+  glUniform1i(m_screenShader.getUniformLocation("lastScreen"), 0);
+  glUniform1i(m_screenShader.getUniformLocation("blurredScreen"), 1);
+  m_screenShader.disable();
+
+  m_weightedPassLocation = m_shader->getUniformLocation("weightedPass");
+  m_oitCompositeShader.enable();
+  glUniform1i(m_oitCompositeShader.getUniformLocation("accumTexture"), 0);
+  glUniform1i(m_oitCompositeShader.getUniformLocation("weightTexture"), 1);
+  m_oitCompositeShader.disable();
+  CHECK_GL_ERRORS;
 }
 
 
@@ -552,47 +1035,37 @@ void Project::setTextureMaps() {
 
 //----------------------------------------------------------------------------------------
 void Project::uploadVertexDataToVbos (
-		const MeshConsolidator & meshConsolidator
+		const IndexedMeshes & meshes,
+		const PackedVertices & vertices
 ) {
-	// Generate VBO to store all vertex position data
+	// Generate VBO to store all interleaved vertex data
 	{
-		glGenBuffers(1, &m_vbo_vertexPositions);
+		glGenBuffers(1, &m_vbo_vertices);
 
-		glBindBuffer(GL_ARRAY_BUFFER, m_vbo_vertexPositions);
+		glBindBuffer(GL_ARRAY_BUFFER, m_vbo_vertices);
 
-		glBufferData(GL_ARRAY_BUFFER, meshConsolidator.getNumVertexPositionBytes(),
-				meshConsolidator.getVertexPositionDataPtr(), GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, vertices.data.size(), vertices.data.data(), GL_STATIC_DRAW);
 
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 		CHECK_GL_ERRORS;
 	}
 
-	// Generate VBO to store all vertex normal data
+	// Generate the index buffer, 16 bit when the vertices allow it
 	{
-		glGenBuffers(1, &m_vbo_vertexNormals);
+		m_indexType = meshes.indexType();
+		m_indexSize = meshes.indexSize();
+		vector<char> indices = meshes.packedIndices();
 
-		glBindBuffer(GL_ARRAY_BUFFER, m_vbo_vertexNormals);
+		glGenBuffers(1, &m_ibo_indices);
 
-		glBufferData(GL_ARRAY_BUFFER, meshConsolidator.getNumVertexNormalBytes(),
-				meshConsolidator.getVertexNormalDataPtr(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo_indices);
 
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size(), indices.data(), GL_STATIC_DRAW);
+
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		CHECK_GL_ERRORS;
 	}
 
-  // Generate VBO to store all vertex uv data
-  {
-    glGenBuffers(1, &m_vbo_vertexUVs);
-
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo_vertexUVs);
-
-    glBufferData(GL_ARRAY_BUFFER, meshConsolidator.getNumVertexUVBytes(),
-        meshConsolidator.getVertexUVDataPtr(), GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    CHECK_GL_ERRORS;
-  }
-
   {
     float quadVertices[] = {
         // positions   // texCoords
@@ -666,18 +1139,11 @@ void Project::uploadVertexDataToVbos (
     m_skyboxShader.disable();
   }
 
-  {
-    glGenBuffers(1, &m_vbo_vertexTangents);
-
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo_vertexTangents);
-
-    glBufferData(GL_ARRAY_BUFFER, meshConsolidator.getNumVertexTangentBytes(),
-        meshConsolidator.getVertexTangentDataPtr(), GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    CHECK_GL_ERRORS;
-  }
-
+  // Per-instance data of every pass, refilled each frame.
+  m_drawRing.init(1024 * sizeof(InstanceData));
+  m_lightClusters.init();
+  m_profiler.init();
+  CHECK_GL_ERRORS;
 }
 
 //----------------------------------------------------------------------------------------
@@ -716,7 +1182,7 @@ void Project::mapVboDataToVertexShaderInputLocations()
 void Project::initPerspectiveMatrix()
 {
 	float aspect = ((float)m_windowWidth) / m_windowHeight;
-	m_perpsective = glm::perspective(degreesToRadians(60.0f), aspect, 0.1f, 100.0f);
+	m_perpsective = glm::perspective(degreesToRadians(60.0f), aspect, NEAR_PLANE, FAR_PLANE);
 }
 
 //----------------------------------------------------------------------------------------
@@ -727,10 +1193,14 @@ void Project::initViewMatrix() {
 
 //----------------------------------------------------------------------------------------
 void Project::updateLightSources() {
-  if (m_inspecting)
+  // The light moves in steps so the static shadow map can be reused; shading
+  // and shadows both use the stepped position so they stay in agreement.
+  int lightFrame = m_frame - m_frame % LIGHT_FRAME_STEP;
+  if (m_inspecting) {
     m_light.position = vec3(2,2,-10);
-  else
-    m_light.position = vec3(glm::sin((double)m_frame/MAX_FRAME * 2 *glm::pi<double>()) * 7, 2,-10);
+  } else {
+    m_light.position = vec3(glm::sin((double)lightFrame/MAX_FRAME * 2 *glm::pi<double>()) * 7, 2,-10);
+  }
 	m_light.rgbIntensity = vec3(0.8f); // White light
 
   // glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, 0.0f, 50.0f)
@@ -743,8 +1213,25 @@ void Project::updateLightSources() {
 
 //----------------------------------------------------------------------------------------
 void Project::uploadCommonSceneUniforms() {
-  m_shader->uploadCommonSceneUniforms(this);
-  m_depthMapShader->uploadCommonSceneUniforms(this);
+  m_frameUniforms.perspective = m_perpsective;
+  m_frameUniforms.view = m_view;
+  m_frameUniforms.lightSpaceMatrix = m_lightSpaceMatrix;
+  m_frameUniforms.viewPos = m_viewPos;
+  m_frameUniforms.lightPosition = m_light.position;
+  m_frameUniforms.lightIntensity = m_light.rgbIntensity;
+  m_frameUniforms.ambientIntensity = vec3(0.1f);
+  m_frameUniforms.showShadows = m_show_shadows;
+  m_frameUniforms.showTextures = m_show_textures;
+  m_frameUniforms.showTransparent = m_show_transparent;
+  m_frameUniforms.showPointLights = m_show_point_lights;
+  m_frameUniforms.clusterTileScale = vec2((float)CLUSTERS_X / m_windowWidth, (float)CLUSTERS_Y / m_windowHeight);
+  m_frameUniforms.clusterZScale = m_lightClusters.zScale();
+  m_frameUniforms.clusterZBias = m_lightClusters.zBias();
+
+  glBindBuffer(GL_UNIFORM_BUFFER, m_ubo_frame);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &m_frameUniforms);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  CHECK_GL_ERRORS;
 }
 
 static int skyboxFrame = 0;
@@ -755,26 +1242,16 @@ void Project::renderSkybox() {
 
   mat4 skyboxModel =glm::rotate(glm::radians(-15.0f), vec3(1,0,0)) * glm::rotate((float)skyboxFrame/maxSkyboxFrame* 2 *glm::pi<float>(), vec3(0,1,0));
   glDepthMask(GL_FALSE);
-  m_skyboxShader.enable();
-
-  GLint location = m_skyboxShader.getUniformLocation("model");
-  glUniformMatrix4fv(location, 1, GL_FALSE, value_ptr(skyboxModel));
-  CHECK_GL_ERRORS;
+  m_renderState.useProgram(m_skyboxShader);
 
-  location = m_skyboxShader.getUniformLocation("view");
-  glUniformMatrix4fv(location, 1, GL_FALSE, value_ptr(m_view));
-  CHECK_GL_ERRORS;
-
-  location = m_skyboxShader.getUniformLocation("projection");
-  glUniformMatrix4fv(location, 1, GL_FALSE, value_ptr(m_perpsective));
+  glUniformMatrix4fv(m_skyboxModelLocation, 1, GL_FALSE, value_ptr(skyboxModel));
   CHECK_GL_ERRORS;
 
   glBindVertexArray(m_vao_skybox);
   glBindTexture(GL_TEXTURE_CUBE_MAP, m_skybox);
   glDrawArrays(GL_TRIANGLES,0,36);
+  m_renderState.countDraw();
   glDepthMask(GL_TRUE);
-
-  m_skyboxShader.disable();
 }
 
 //----------------------------------------------------------------------------------------
@@ -785,19 +1262,17 @@ void Project::appLogic()
 {
   m_frame = (m_frame + 1)%MAX_FRAME;
   updateLightSources();
-
-  // TODO rotation of each bubble type
-  for (int i = 0; i < bubbleTypes.size(); i++) {
-    bubbleTypes[i]->rotate('x', btRot[i].x);
-    bubbleTypes[i]->rotate('y', btRot[i].y);
-    bubbleTypes[i]->rotate('z', btRot[i].z);
-  }
+  updatePointLights();
 
   tickGameLogic();
   tickBubbleMovement();
+
+  // One frame of animation: bubble type spin and the cannon.
+  m_animator.update(1.0f);
 }
 
 void Project::tickGameLogic() {
+  if (m_headless) return;
   if (glfwGetKey(m_window, GLFW_KEY_LEFT) == GLFW_PRESS) rotateCannon(-1);
   else if (glfwGetKey(m_window, GLFW_KEY_RIGHT) == GLFW_PRESS) rotateCannon(1);
 }
@@ -816,8 +1291,10 @@ vec2 intersection(vec2 l1p, vec2 l1v, vec2 l2p, vec2 l2v) {
 }
 
 bool Project::checkBBoxCollisions() {
-  vec2 pp = vec2(m_newBubble->position);
-  vec2 mv = glm::vec2(m_newBubble->moveVector);
+  PhysicsBody &body = m_components.bodies.get(m_newBubble->m_entity);
+  vec3 &position = m_components.transforms.get(m_newBubble->m_entity).position;
+  vec2 pp = vec2(position);
+  vec2 mv = glm::vec2(body.velocity);
   vec2 pdir = glm::normalize(mv);
   float bboxdir[4][2] = {{0,1}, {0, 1}, {1,0}, {1,0}};
   float bpts[4][2] = {{BOARD_SIDE,0}, {-BOARD_SIDE, 0}, {0,boardTop}, {0,BOARD_BOTTOM}};
@@ -832,11 +1309,11 @@ bool Project::checkBBoxCollisions() {
     vec2 btopp = pp - bpt;
     vec2 proj = bvec * glm::dot(btopp, bvec) / glm::dot(bvec, bvec) + bpt;
     float angle = glm::angle(pdir, bvec);
-    if (glm::dot(btopp, n) < 0 || glm::distance(proj, pp) < m_newBubble->collisionRadius) {
+    if (glm::dot(btopp, n) < 0 || glm::distance(proj, pp) < body.radius) {
       cerr << i << endl;
       vec2 iPoint = intersection(bpt, bvec, pp, pdir);
-      m_newBubble->position = vec3((-pdir) * (m_newBubble->collisionRadius / glm::sin(angle) + EPSILON) + iPoint, m_newBubble->position.z);
-      m_newBubble->setMoveVector(glm::vec3(mv - 2 * glm::dot(mv, n) * n,0));
+      position = vec3((-pdir) * (body.radius / glm::sin(angle) + EPSILON) + iPoint, position.z);
+      body.velocity = glm::vec3(mv - 2 * glm::dot(mv, n) * n,0);
       
       hitTop = i == 2;
     }
@@ -853,46 +1330,88 @@ void Project::inspectReady() {
     return;
   }
 
-  if (glm::dot(m_newBubble->moveVector, vec3(1,1,1)) != 0) return;
+  if (glm::dot(m_components.bodies.get(m_newBubble->m_entity).velocity, vec3(1,1,1)) != 0) return;
 
   m_newBubble->translate(inspectPos);
   m_inspecting = !m_inspecting;
 }
 
 bool Project::checkBBlCollisions() {
-  vec2 pp = vec2(m_newBubble->position);
-  vec2 mv = glm::vec2(m_newBubble->moveVector);
+  const EntityId newId = m_newBubble->m_entity;
+  PhysicsBody &body = m_components.bodies.get(newId);
+  vec3 &position = m_components.transforms.get(newId).position;
+  vec2 pp = vec2(position);
+  vec2 mv = glm::vec2(body.velocity);
   vec2 pdir = glm::normalize(mv);
 
   bool hit = false;
-  for (std::set<BubbleNode *>::iterator it = m_fixedBubbles.begin(); it != m_fixedBubbles.end(); it++) {
-    BubbleNode *bbl = *it;
-    vec2 bblpos(bbl->position);
+  const ComponentArray<PhysicsBody> &bodies = m_components.bodies;
+  const ComponentArray<TransformComponent> &transforms = m_components.transforms;
+  for (size_t b = 0; b < bodies.size(); b++) {
+    EntityId id = bodies.entity(b);
+    if (id == newId) continue; // every other body is a fixed bubble
+    assert(transforms.entity(b) == id);
+    vec2 bblpos(transforms[b].position);
     vec2 ptobbl(bblpos - pp);
     vec2 proj = pp + pdir * glm::dot(ptobbl, pdir) / glm::dot(pdir, pdir);
 
-    float mindist = m_newBubble->collisionRadius + bbl->collisionRadius;
+    float mindist = body.radius + bodies[b].radius;
     if (glm::distance(bblpos, pp) < mindist) {
-      DEBUGM(cerr << glm::distance(bblpos, pp) << " " << m_newBubble->collisionRadius << " " << bbl->collisionRadius << endl);
+      DEBUGM(cerr << glm::distance(bblpos, pp) << " " << body.radius << " " << bodies[b].radius << endl);
 
       float projd = glm::distance(proj, bblpos);
       float along = glm::sqrt(mindist * mindist - projd * projd) + EPSILON;
       float alongdir = glm::dot(mv, ptobbl) > 0 ? -1:1;
-      m_newBubble->position = vec3(proj + alongdir * pdir * along, m_newBubble->position.z);
-      DEBUGM(cerr << "newPos" << m_newBubble->position << endl);
-      m_newBubble->setMoveVector(vec3(0));
+      position = vec3(proj + alongdir * pdir * along, position.z);
+      DEBUGM(cerr << "newPos" << position << endl);
+      body.velocity = vec3(0);
       hit = true;
     }
   }
   return hit;
 }
 
+//----------------------------------------------------------------------------------------
+// World space point lights for this frame: one per bubble, plus the pop
+// flashes still fading out.
+void Project::updatePointLights() {
+  mat4 boardToWorld;
+  for (const SceneNode *node : m_bubblesHolderPath) {
+    boardToWorld = boardToWorld * node->get_transform();
+  }
+
+  m_pointLights.clear();
+  const ComponentArray<BubbleColour> &colours = m_components.colours;
+  for (size_t slot = 0; slot < colours.size(); slot++) {
+    EntityId id = colours.entity(slot);
+    if (!m_components.transforms.has(id)) continue;
+    vec3 position = vec3(boardToWorld * vec4(m_components.transforms.get(id).position, 1.0f));
+    m_pointLights.push_back(PointLight(position, GLOW_RADIUS,
+        m_bubbleGlowColours[colours[slot].type] * GLOW_INTENSITY));
+  }
+
+  size_t live = 0;
+  for (PopFlash &flash : m_popFlashes) {
+    if (++flash.age >= POP_FLASH_FRAMES) continue;
+    float fade = 1.0f - (float)flash.age / POP_FLASH_FRAMES;
+    m_pointLights.push_back(PointLight(vec3(boardToWorld * vec4(flash.position, 1.0f)),
+        POP_FLASH_RADIUS, flash.colour * (POP_FLASH_INTENSITY * fade)));
+    m_popFlashes[live++] = flash;
+  }
+  m_popFlashes.resize(live);
+}
+
+void Project::addPopFlash(int i, int j) {
+  EntityId id = bubbleGrid[i][j]->m_entity;
+  PopFlash flash;
+  flash.position = m_components.transforms.get(id).position;
+  flash.colour = m_bubbleGlowColours[m_components.colours.get(id).type];
+  flash.age = 0;
+  m_popFlashes.push_back(flash);
+}
+
 void Project::removeBubble(int i, int j) {
-  BubbleNode *bubble = bubbleGrid[i][j];
-  m_fixedBubbles.erase(bubble);
-  m_bubblesHolder->remove_child(bubble);
-  bubble->children.clear();
-  delete bubble;
+  destroyBubble(bubbleGrid[i][j]);
   bubbleGrid[i][j] = nullptr;
 }
 
@@ -915,7 +1434,7 @@ bool Project::checkForGroups(int si, int sj, size_t checkType) {
       int nj = around[c][1] + p.second;
 
       if (ni < 0 || ni >= GRID_WIDTH || nj < 0 || nj >= gridHeight) continue;
-      if (bubbleGrid[ni][nj] && bubbleGrid[ni][nj]->type == checkType) {
+      if (bubbleGrid[ni][nj] && m_components.colours.get(bubbleGrid[ni][nj]->m_entity).type == checkType) {
         auto nij = make_pair(ni, nj);
         if (seen.count(nij) != 0) continue;
 
@@ -930,6 +1449,7 @@ bool Project::checkForGroups(int si, int sj, size_t checkType) {
     m_soundManager.playSound("blop");
     for (auto it = seen.begin(); it != seen.end(); it++) {
       auto e = *it;
+      addPopFlash(e.first, e.second);
       removeBubble(e.first, e.second);
     }
     return true;
@@ -985,50 +1505,50 @@ bool Project::checkForDisconnected() {
 }
 
 void Project::createBubbleAt(int i, int j, size_t type) {
-  BubbleNode*newBubble = new BubbleNode("bubble");
-  newBubble->collisionRadius= SPHERE_RAD;
-  newBubble->type = type;
-  
-  newBubble->setPos(getPosFromGrid(i,j));
-  m_fixedBubbles.insert(newBubble);
-  bubbleGrid[i][j] = newBubble;
+  bubbleGrid[i][j] = spawnBubble(getPosFromGrid(i,j), type);
+}
 
-  newBubble->add_child(bubbleTypes[type]);
-  m_bubblesHolder->add_child(newBubble);
+// Move every body by its velocity.
+void Project::tickPhysics() {
+  ComponentArray<PhysicsBody> &bodies = m_components.bodies;
+  ComponentArray<TransformComponent> &transforms = m_components.transforms;
+  for (size_t b = 0; b < bodies.size(); b++) {
+    if (bodies[b].velocity == vec3(0)) continue;
+    assert(transforms.entity(b) == bodies.entity(b));
+    transforms[b].position += bodies[b].velocity;
+  }
 }
 
 void Project::tickBubbleMovement() { // ASSUME only 2d collisions
-  m_newBubble->move();
+  tickPhysics();
   
   if (checkBBlCollisions() || checkBBoxCollisions()) {
-    m_newBubble->setMoveVector(vec3(0));
+    const EntityId newId = m_newBubble->m_entity;
+    m_components.bodies.get(newId).velocity = vec3(0);
     int i, j;
-    getNearestGrid(m_newBubble->position, i, j);
+    getNearestGrid(m_components.transforms.get(newId).position, i, j);
     DEBUGM(cerr << "round " << i << " " << j << endl);
 
     if (j >= gridHeight) {
-      m_bubblesHolder->remove_child(m_newBubble);
-      m_newBubble->children.clear();
-      delete m_newBubble;
+      destroyBubble(m_newBubble);
       m_newBubble = nullptr;
       bubbleOffGrid();
       readyBubble();
     } else {
       /*GeometryNode *newBubble = new GeometryNode("sphere", "bubble");
       newBubble->scale(vec3(0.5));
-      newBubble->setPos(m_newBubble->position);
+      newBubble->translate(m_newBubble->position);
       newBubble->material.kd = vec3(1);
       m_bubblesHolder->add_child(newBubble);
   */
       BubbleNode *tempbbl = m_newBubble;
-      tempbbl->position = getPosFromGrid(i, j);
+      m_components.transforms.get(newId).position = getPosFromGrid(i, j);
 
-      m_fixedBubbles.insert(tempbbl);
       readyBubble();
 
       bubbleGrid[i][j] = tempbbl;
 
-      if (checkForGroups(i, j, tempbbl->type) && checkForDisconnected()) {
+      if (checkForGroups(i, j, m_components.colours.get(newId).type) && checkForDisconnected()) {
         //m_soundManager.playSound("bazinga");
         m_soundManager.playSound("applause");
         resetBoard();
@@ -1080,19 +1600,64 @@ void Project::guiLogic()
 
 		ImGui::Text( "Framerate: %.1f FPS\n", ImGui::GetIO().Framerate );
 
+    // Rolling means and 95th percentiles of each stage of draw()
+    float cpuTotal = 0, gpuTotal = 0;
+    for (int s = 0; s < NUM_FRAME_STAGES; s++) {
+      FrameProfiler::Stats cpu = m_profiler.cpuStats((FrameStage)s);
+      FrameProfiler::Stats gpu = m_profiler.gpuStats((FrameStage)s);
+      ImGui::Text( "%-11s cpu %6.2f (p95 %6.2f)  gpu %6.2f (p95 %6.2f) ms",
+          frameStageName((FrameStage)s), cpu.mean, cpu.p95, gpu.mean, gpu.p95);
+      cpuTotal += cpu.mean;
+      gpuTotal += gpu.mean;
+    }
+    ImGui::Text( "%-11s cpu %6.2f               gpu %6.2f ms, %d queries dropped",
+        "total", cpuTotal, gpuTotal, m_profiler.dropped());
+    if( ImGui::Button( "Export Timings" ) ) {
+      if (m_profiler.exportCsv(TIMINGS_FILE)) {
+        cout << "Wrote " << TIMINGS_FILE << endl;
+      } else {
+        cerr << "Could not write " << TIMINGS_FILE << endl;
+      }
+    }
+
 		ImGui::Text( "Cannon angle: %.1f FPS", m_cannonAngle);
 
     ImGui::Text( "Inspecting (I): %d", m_inspecting);
+    if (m_cursorHit.node && (m_cursorHit.bubble == NO_ENTITY || m_components.colours.has(m_cursorHit.bubble))) {
+      ImGui::Text( "Cursor: %s, cell (%d, %d)", m_cursorHit.node->m_name.c_str(), m_cursorHit.gridI, m_cursorHit.gridJ);
+    }
+    if (m_inspecting && m_components.colours.has(m_selectedHit.bubble)) {
+      ImGui::Text( "Selected bubble: type %d, cell (%d, %d)",
+          (int)m_components.colours.get(m_selectedHit.bubble).type, m_selectedHit.gridI, m_selectedHit.gridJ);
+    }
     ImGui::Text( "Cycle Types (C): %d", cycleTypes);
     ImGui::Text( "Turns Until Lower (L): %d\n", (int)curTurnsUntilLower);
+    ImGui::Text( "Draws: %d shadow, %d opaque, %d transparent, %d ui of %d\n",
+        (int)(m_staticShadowQueue.size() + m_dynamicShadowQueue.size()), (int)m_opaqueQueue.size(),
+        (int)m_transparentQueue.size(), (int)m_uiQueue.size(), (int)m_drawItems.size());
+    ImGui::Text( "Instanced draw calls: %d shadow, %d opaque\n", m_shadowDrawCalls, m_opaqueDrawCalls);
+    ImGui::Text( "Transparent sort: %d items, %.1f us\n", (int)m_transparentQueue.size(), m_transparentSortMicros);
+    ImGui::Text( "Shadow casters: %d static (%d map renders), %d dynamic\n",
+        (int)m_staticShadowQueue.size(), m_staticShadowRenders, (int)m_dynamicShadowQueue.size());
+    ImGui::Text( "Instance data: %d KB, %s, %d stalls\n",
+        (int)(m_instanceData.size() * sizeof(InstanceData) / 1024),
+        m_drawRing.persistent() ? "persistent" : "orphaned", m_drawRing.stalls());
+    const RenderState::Counters &stateCounters = m_renderState.counters();
+    ImGui::Text( "State changes: %d programs, %d textures, %d draw calls\n",
+        stateCounters.programChanges, stateCounters.textureChanges, stateCounters.drawCalls);
 
     ImGui::Text( "Textures (1): %d", m_show_textures);
     ImGui::Text( "Bumps (2): %d", m_show_bump);
     ImGui::Text( "Shadows (3): %d", m_show_shadows);
-    ImGui::Text( "Blur (4): %d", m_show_blur);
+    ImGui::Text( "Blur (4): %d, at 1/%d resolution (6)", m_show_blur, m_postScale);
     ImGui::Text( "Transparency (5): %d", m_show_transparent);
+    ImGui::Text( "Weighted OIT (7): %d", m_weighted_transparency);
+    ImGui::Text( "Point lights (8): %d, %d lit, %d cluster entries, at most %d per cluster",
+        m_show_point_lights, (int)m_lightClusters.numLights(), (int)m_lightClusters.numIndices(),
+        m_lightClusters.maxPerCluster());
     ImGui::Text("Other controls: \n(A) Toggle all\n(S) Play sound"
-         "\n(B) Reset BG music\n(R) Reset\n(P) Regen Marble Texture");
+         "\n(B) Reset BG music\n(R) Reset\n(P) Regen Marble Texture"
+         "\n(Mouse) Aim, click to shoot\n(Click while inspecting) Select bubble");
 
 	ImGui::End();
 }
@@ -1102,191 +1667,456 @@ void Project::guiLogic()
  * Called once per frame, after guiLogic().
  */
 void Project::draw() {
-	uploadCommonSceneUniforms();
+  m_profiler.beginFrame();
+  {
+    ScopedStageTimer timer(m_profiler, STAGE_BUILD);
+    buildDrawLists();
+    uploadCommonSceneUniforms();
+    m_lightClusters.upload();
+    m_instanceOffset = m_drawRing.upload(m_instanceData.data(), m_instanceData.size() * sizeof(InstanceData));
+  }
+  m_renderState.beginFrame();
 	glClearColor(0.35, 0.35, 0.35, 1.0);
 
   CHECK_GL_ERRORS;
 
   // Render depth map
-  glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-  glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_depthMap);
-  glEnable(GL_DEPTH_TEST);
-  glClear(GL_DEPTH_BUFFER_BIT);
-  glEnable(GL_CULL_FACE);
-  glCullFace(GL_FRONT);
-  renderSceneGraph(*m_depthMapShader, *m_rootNode); // render trans for shadows
-  glCullFace(GL_BACK);
-  glDisable(GL_CULL_FACE);
-  glDisable(GL_DEPTH_TEST);
+  {
+    ScopedStageTimer timer(m_profiler, STAGE_SHADOW);
+    glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_FRONT);
+    m_shadowDrawCalls = 0;
+    if (!m_staticShadowValid || m_staticShadowKey != m_cachedStaticShadowKey) {
+      glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_staticDepthMap);
+      glClear(GL_DEPTH_BUFFER_BIT);
+      m_shadowDrawCalls += renderQueue(*m_depthMapShader, m_staticShadowQueue, m_staticShadowInstances);
+      m_cachedStaticShadowKey = m_staticShadowKey;
+      m_staticShadowValid = true;
+      m_staticShadowRenders++;
+    }
+    // Start from the static casters and add the moving ones.
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo_staticDepthMap);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_fbo_depthMap);
+    glBlitFramebuffer(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT, 0, 0, SHADOW_WIDTH, SHADOW_HEIGHT,
+        GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_depthMap);
+    m_shadowDrawCalls += renderQueue(*m_depthMapShader, m_dynamicShadowQueue, m_dynamicShadowInstances);
+    glCullFace(GL_BACK);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_DEPTH_TEST);
+  }
 
   CHECK_GL_ERRORS;
 
-  glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_lastScreen); 
-  glBindVertexArray(m_shader->m_vao);
-  glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+  {
+    ScopedStageTimer timer(m_profiler, STAGE_SKYBOX);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_lastScreen); 
+    glBindVertexArray(m_shader->m_vao);
+    glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
   
-  //// Render the actual scene
-  glViewport(0, 0, m_windowWidth, m_windowHeight);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    //// Render the actual scene
+    glViewport(0, 0, m_windowWidth, m_windowHeight);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  renderSkybox();
+    renderSkybox();
+  }
 
-  glActiveTexture(GL_TEXTURE2);
-  glBindTexture(GL_TEXTURE_2D, m_depthMap);
+  {
+    ScopedStageTimer timer(m_profiler, STAGE_OPAQUE);
+    m_renderState.bindTexture(2, m_depthMap);
 
-  glEnable( GL_DEPTH_TEST );
-  //glEnable(GL_CULL_FACE);
-  renderSceneGraph(*m_shader, *m_rootNode);
+    glEnable( GL_DEPTH_TEST );
+    //glEnable(GL_CULL_FACE);
+    m_opaqueDrawCalls = renderQueue(*m_shader, m_opaqueQueue, m_opaqueInstances);
+  }
 
-  
-  renderTransparentNodes(*m_shader, *m_rootNode);
+  {
+    ScopedStageTimer timer(m_profiler, STAGE_TRANSPARENT);
+    if (m_weighted_transparency) {
+      renderWeightedTransparentNodes(*m_shader);
+    } else {
+      renderTransparentNodes(*m_shader);
+    }
+  }
+
+  // UI layer nodes go over the scene
+  {
+    ScopedStageTimer timer(m_profiler, STAGE_UI);
+    if (!m_uiQueue.empty()) {
+      glClear(GL_DEPTH_BUFFER_BIT);
+      renderQueue(*m_shader, m_uiQueue, m_uiInstances);
+    }
+  }
+  m_drawRing.endFrame();
   
   //glDisable(GL_CULL_FACE);
   glDisable(GL_DEPTH_TEST);
   
 
-  glBindFramebuffer(GL_FRAMEBUFFER, m_blurredScreen);
+  renderPostChain();
+}
+
+// Blend the scene over the blur history at the reduced resolution, then
+// composite the scene and the history to the back buffer in one pass. The
+// composite reads the same history the new one was built from, so it shows
+// exactly what the history now holds, at full resolution for the scene term.
+void Project::renderPostChain() {
   glDisable(GL_DEPTH_TEST);
+  glBindVertexArray(m_vao_screen);
+  m_renderState.useProgram(m_screenShader);
+
+  GLuint history = m_history[m_historyIndex];
+  if (m_show_blur) {
+    ScopedStageTimer timer(m_profiler, STAGE_BLUR);
+    if (!m_historyValid) {
+      // Seed the history with the current frame rather than blending in black.
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo_lastScreen);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_fbo_history[m_historyIndex]);
+      glBlitFramebuffer(0, 0, m_windowWidth, m_windowHeight, 0, 0, m_postWidth, m_postHeight,
+          GL_COLOR_BUFFER_BIT, GL_LINEAR);
+      m_historyValid = true;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_history[1 - m_historyIndex]);
+    glViewport(0, 0, m_postWidth, m_postHeight);
+    m_renderState.bindTexture(0, m_lastScreen);
+    m_renderState.bindTexture(1, history);
+    glUniform1i(m_screenDoBlurLocation, 1);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    CHECK_GL_ERRORS;
+  } else {
+    // Start over from the current frame when blur comes back on.
+    m_historyValid = false;
+  }
+
   {
-    m_screenShader.enable(); // TODO: cleanup
-    GLuint location = m_screenShader.getUniformLocation("lastScreen");
-    glUniform1i(location, 0);
-    location = m_screenShader.getUniformLocation("blurredScreen");
-    glUniform1i(location, 1);
-    m_screenShader.disable();
-    
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, m_lastScreen);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, m_blurredScreen);
+    ScopedStageTimer timer(m_profiler, STAGE_PRESENT);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_output);
+    glViewport(0, 0, m_windowWidth, m_windowHeight);
+    m_renderState.bindTexture(0, m_lastScreen);
+    m_renderState.bindTexture(1, history);
+    glUniform1i(m_screenDoBlurLocation, m_show_blur);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
   }
-  // Draw the last screen to the blurredscreen then to the real screen
-  
-  glBindVertexArray(m_vao_screen);
 
-  m_screenShader.enable();
+  if (m_show_blur) m_historyIndex = 1 - m_historyIndex;
 
-  GLuint location = m_screenShader.getUniformLocation("doBlur");
-  glUniform1i(location, m_show_blur);
   CHECK_GL_ERRORS;
+  glBindVertexArray(0);
+}
 
-  glDrawArrays(GL_TRIANGLES, 0, 6);
-  m_screenShader.disable();
+void Project::renderTransparentNodes(const SceneGraphShader &shader) { 
+  glEnable(GL_CULL_FACE);
+  glCullFace(GL_BACK);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  // queue is sorted back to front by sortTransparentQueue(), so runs of one
+  // mesh can still be drawn as instances: they are drawn in order.
+  renderQueue(shader, m_transparentQueue, m_transparentInstances);
 
-  CHECK_GL_ERRORS;
+  glDisable(GL_CULL_FACE);
 
-  glBindFramebuffer(GL_FRAMEBUFFER,0);
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, m_blurredScreen);
-  glActiveTexture(GL_TEXTURE1);
-  glBindTexture(GL_TEXTURE_2D, m_blurredScreen);
+  glDisable(GL_BLEND);
+}
 
-  m_screenShader.enable();
-  glDrawArrays(GL_TRIANGLES, 0, 6);
-  m_screenShader.disable();
+// Draw the transparent queue in any order into the OIT targets, then blend the
+// weighted average of its fragments over m_fbo_lastScreen. One blend function
+// serves both targets (GL 3.3 has no per-target blending): colours add up in
+// m_oitAccum.rgb and weights in m_oitWeight.r, while m_oitAccum.a multiplies
+// down the revealage, starting from 1.
+void Project::renderWeightedTransparentNodes(const SceneGraphShader &shader) {
+  if (m_transparentQueue.empty()) return;
+
+  glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_oit);
+  const GLfloat accumClear[4] = {0, 0, 0, 1};
+  const GLfloat weightClear[4] = {0, 0, 0, 0};
+  glClearBufferfv(GL_COLOR, 0, accumClear);
+  glClearBufferfv(GL_COLOR, 1, weightClear);
+
+  glEnable(GL_CULL_FACE);
+  glCullFace(GL_BACK);
+  glDepthMask(GL_FALSE);
+  glEnable(GL_BLEND);
+  glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
 
+  m_renderState.useProgram(shader);
+  glUniform1i(m_weightedPassLocation, 1);
+  renderQueue(shader, m_transparentQueue, m_transparentInstances);
+  glUniform1i(m_weightedPassLocation, 0);
+
+  glDepthMask(GL_TRUE);
+  glDisable(GL_CULL_FACE);
+  CHECK_GL_ERRORS;
+
+  // Composite over the opaque scene.
+  glBindFramebuffer(GL_FRAMEBUFFER, m_fbo_lastScreen);
+  glDisable(GL_DEPTH_TEST);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  m_renderState.bindTexture(0, m_oitAccum);
+  m_renderState.bindTexture(1, m_oitWeight);
+  m_renderState.useProgram(m_oitCompositeShader);
+  glBindVertexArray(m_vao_screen);
+  glDrawArrays(GL_TRIANGLES, 0, 6);
+  glEnable(GL_DEPTH_TEST);
+  glDisable(GL_BLEND);
   CHECK_GL_ERRORS;
-  glBindVertexArray(0);
-  glBindFramebuffer(GL_FRAMEBUFFER,0);
 }
 
-void Project::collectTransparentNodesRecursive(const SceneNode &root, const glm::mat4 &parentTransform, std::vector<std::pair<const GeometryNode *, glm::mat4> > &transparentNodes) {
-  if (root.m_name == HIDDEN) return;
+//----------------------------------------------------------------------------------------
+// Append a DrawItem for every drawable GeometryNode under root (or for root
+// alone if selfOnly), children before parents.
+void Project::collectDrawItems(const SceneNode &root, const glm::mat4 &parentTransform, unsigned int parentLayers, bool selfOnly, vector<DrawItem> &items) const {
+  if (root.m_layers & LAYER_HIDDEN) return;
   glm::mat4 myTrans = parentTransform * root.get_transform();
-  for (const SceneNode * node : root.children) {
-    collectTransparentNodesRecursive(*node, myTrans, transparentNodes);
+  unsigned int myLayers = parentLayers | (root.m_layers & INHERITED_LAYERS);
+  if (!selfOnly) {
+    for (const SceneNode * node : root.children) {
+      collectDrawItems(*node, myTrans, myLayers, false, items);
+    }
   }
 
   if (root.m_nodeType != NodeType::GeometryNode) return;
 
   const GeometryNode * geometryNode = static_cast<const GeometryNode *>(&root);
+  if (geometryNode->meshHandle < 0) return;
+
+  DrawItem item;
+  item.node = geometryNode;
+  item.transform = myTrans;
+  item.bounds = transformAabb(m_meshBounds[geometryNode->meshHandle], myTrans);
+  item.layers = geometryNode->m_layers | myLayers;
+  items.push_back(item);
+}
 
-  if (geometryNode->material.transparency == 1) return;
-
-  transparentNodes.push_back(make_pair(geometryNode, myTrans));
+// Cut the graph into at least targetTasks independent traversal tasks (when it
+// is big enough) by repeatedly replacing subtree tasks with one task per child
+// followed by a self-only task, which keeps the children-before-parent order.
+void Project::splitTraversal(const SceneNode &root, size_t targetTasks) {
+  m_traversalTasks.clear();
+  m_traversalTasks.push_back(TraversalTask{&root, mat4(), 0, false});
+
+  vector<TraversalTask> next;
+  bool split = true;
+  while (split && m_traversalTasks.size() < targetTasks) {
+    split = false;
+    next.clear();
+    for (const TraversalTask &task : m_traversalTasks) {
+      const SceneNode *node = task.node;
+      if (task.selfOnly || node->children.empty() || (node->m_layers & LAYER_HIDDEN)) {
+        next.push_back(task);
+        continue;
+      }
+      mat4 myTrans = task.parentTransform * node->get_transform();
+      unsigned int myLayers = task.parentLayers | (node->m_layers & INHERITED_LAYERS);
+      for (const SceneNode *child : node->children) {
+        next.push_back(TraversalTask{child, myTrans, myLayers, false});
+      }
+      next.push_back(TraversalTask{node, task.parentTransform, task.parentLayers, true});
+      split = true;
+    }
+    m_traversalTasks.swap(next);
+  }
 }
 
-void Project::renderTransparentNodes(const SceneGraphShader &shader, const SceneNode &root) { 
-  glEnable(GL_CULL_FACE);
-  glCullFace(GL_BACK);
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-  glBindVertexArray(m_shader->m_vao);
-  vector<pair<const GeometryNode *,mat4>> transparentNodes;
-  // will draw the children before the parents, guaranteed that theyre further away
-  collectTransparentNodesRecursive(*m_rootNode, mat4(), transparentNodes);
-
-  /*
-  vector<float> centroidDistToCamera(transparentNodes.size());
-  for (int i = 0; i < centroidDistToCamera.size(); i++) {
-    auto p = transparentNodes[i];
-    vec3 nodeCentroid = m_batchInfoMap[p.first->meshId].centroid;
-    centroidDistToCamera[i] = glm::distance(vec3(p.second * vec4(nodeCentroid,1.0)), m_viewPos);
+static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+
+// 64 bit FNV-1a of size bytes at data, continuing from hash.
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
   }
-  
-  vector<int> tNodeId(transparentNodes.size());
-  for (int i = 0; i < tNodeId.size(); i++) { tNodeId[i] = i;}
+  return hash;
+}
 
-  sort(tNodeId.begin(), tNodeId.end(), [centroidDistToCamera](int i, int j) {
-      return centroidDistToCamera[i] > centroidDistToCamera[j];
+// CPU stage of the frame: world transforms, bounds, culling and per pass draw
+// lists. Makes no GL calls.
+void Project::buildDrawLists() {
+  static const size_t TASKS_PER_THREAD = 4;
+
+  splitTraversal(*m_rootNode, m_workerPool.size() * TASKS_PER_THREAD);
+  m_taskDrawItems.resize(m_traversalTasks.size());
+  m_workerPool.parallelFor(m_traversalTasks.size(), [this](size_t t) {
+    const TraversalTask &task = m_traversalTasks[t];
+    m_taskDrawItems[t].clear();
+    collectDrawItems(*task.node, task.parentTransform, task.parentLayers, task.selfOnly, m_taskDrawItems[t]);
   });
-*/
 
-  for (int i = 0; i < transparentNodes.size(); i++) {
-    auto p = transparentNodes[i];
-    
-    m_shader->updateShaderUniforms(this, p.first, p.second, m_view);
-    CHECK_GL_ERRORS;
-
-    // Get the BatchInfo corresponding to the GeometryNode's unique MeshId.
-    BatchInfo batchInfo = m_batchInfoMap[p.first->meshId];
+  m_drawItems.clear();
+  for (size_t t = 0; t < m_traversalTasks.size(); t++) {
+    m_drawItems.insert(m_drawItems.end(), m_taskDrawItems[t].begin(), m_taskDrawItems[t].end());
+  }
 
-    //-- Now render the mesh:
-    m_shader->enable();
-    glDrawArrays(GL_TRIANGLES, batchInfo.startIndex, batchInfo.numIndices);
-    m_shader->disable();
+  // Keep the BVH in sync. It is only rebuilt when instances were added or
+  // removed (the leaves no longer line up), otherwise moved leaves are refitted.
+  bool rebuild = m_drawItems.size() != m_bvhNodes.size();
+  for (size_t i = 0; !rebuild && i < m_drawItems.size(); i++) {
+    rebuild = m_drawItems[i].node != m_bvhNodes[i];
+  }
+  if (rebuild) {
+    vector<Aabb> bounds(m_drawItems.size());
+    m_bvhNodes.resize(m_drawItems.size());
+    for (size_t i = 0; i < m_drawItems.size(); i++) {
+      bounds[i] = m_drawItems[i].bounds;
+      m_bvhNodes[i] = m_drawItems[i].node;
+    }
+    m_bvh.build(bounds);
+  } else {
+    for (size_t i = 0; i < m_drawItems.size(); i++) {
+      if (m_drawItems[i].bounds != m_bvh.leafBounds(i)) m_bvh.refitLeaf(i, m_drawItems[i].bounds);
+    }
   }
 
-  glBindVertexArray(0);
-  glDisable(GL_CULL_FACE);
+  m_bvh.query(Frustum(m_perpsective * m_view), m_cameraVisible);
+  m_bvh.query(Frustum(m_lightSpaceMatrix), m_lightVisible);
+
+  m_staticShadowQueue.clear();
+  m_dynamicShadowQueue.clear();
+  m_opaqueQueue.clear();
+  m_transparentQueue.clear();
+  m_uiQueue.clear();
+  for (size_t i = 0; i < m_drawItems.size(); i++) {
+    const DrawItem &drawItem = m_drawItems[i];
+    unsigned int layers = drawItem.layers;
+    RenderItem item;
+    item.world = drawItem.transform;
+    item.mesh = drawItem.node->meshHandle;
+    item.material = drawItem.node->materialHandle;
+    item.node = drawItem.node;
+    const RenderMaterial &material = m_materials[item.material];
+
+    if (layers & LAYER_UI) {
+      item.sortKey = m_uiQueue.size();
+      m_uiQueue.push_back(item);
+      continue;
+    }
+    if ((layers & LAYER_SHADOW_CASTER) && m_lightVisible[i]) {
+      item.sortKey = opaqueSortKey(PASS_SHADOW, PROGRAM_DEPTH_MAP, material, item.material, item.mesh, 0);
+      if (layers & LAYER_DYNAMIC) {
+        m_dynamicShadowQueue.push_back(item);
+      } else {
+        m_staticShadowQueue.push_back(item);
+      }
+    }
+    if (!m_cameraVisible[i]) continue;
 
-  glDisable(GL_BLEND);
-}
+    if (layers & LAYER_OPAQUE) {
+      // View space depth of the node's origin
+      uint32_t depth = quantizeDepth(-(m_view * item.world[3]).z, NEAR_PLANE, FAR_PLANE);
+      item.sortKey = opaqueSortKey(PASS_OPAQUE, PROGRAM_SCENE, material, item.material, item.mesh, depth);
+      m_opaqueQueue.push_back(item);
+    }
+    if (layers & LAYER_TRANSPARENT) {
+      m_transparentQueue.push_back(item);
+    }
+  }
 
-//----------------------------------------------------------------------------------------
-void Project::renderSceneGraph(const SceneGraphShader &shader, const SceneNode & root, bool rt) {
+  m_queueSorter.sort(m_staticShadowQueue);
+  m_queueSorter.sort(m_dynamicShadowQueue);
 
-	// Bind the VAO once here, and reuse for all GeometryNode rendering below.
-	glBindVertexArray(shader.m_vao);
+  // The cached static shadow map stays valid while the light and every static
+  // caster stay put.
+  m_staticShadowKey = hashBytes(FNV_OFFSET_BASIS, &m_lightSpaceMatrix, sizeof(mat4));
+  for (const RenderItem &item : m_staticShadowQueue) {
+    m_staticShadowKey = hashBytes(m_staticShadowKey, &item.world, sizeof(mat4));
+    m_staticShadowKey = hashBytes(m_staticShadowKey, &item.mesh, sizeof(item.mesh));
+  }
+  m_queueSorter.sort(m_opaqueQueue);
+  sortTransparentQueue();
+
+  static const vector<PointLight> noLights;
+  m_lightClusters.assign(m_show_point_lights ? m_pointLights : noLights,
+      m_view, m_perpsective, NEAR_PLANE, FAR_PLANE);
+
+  // Instance data of every queue back to back, uploaded at once by draw().
+  m_instanceData.clear();
+  m_staticShadowInstances = appendInstanceData(m_staticShadowQueue, false);
+  m_dynamicShadowInstances = appendInstanceData(m_dynamicShadowQueue, false);
+  m_opaqueInstances = appendInstanceData(m_opaqueQueue, true);
+  m_transparentInstances = appendInstanceData(m_transparentQueue, true);
+  m_uiInstances = appendInstanceData(m_uiQueue, true);
+}
 
-  renderSceneGraphRecursive(shader, mat4(), root, rt);
+// Order m_transparentQueue back to front by the view space depth of each item's
+// mesh centroid, or by state alone under weighted transparency. Only the
+// view's z row is needed, so the depth of an item is one matrix-vector product
+// and a dot product.
+void Project::sortTransparentQueue() {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  vec4 viewZ(m_view[0][2], m_view[1][2], m_view[2][2], m_view[3][2]);
+  for (RenderItem &item : m_transparentQueue) {
+    if (m_weighted_transparency) {
+      // Order does not matter to OIT; only group by state for instancing.
+      item.sortKey = opaqueSortKey(PASS_TRANSPARENT, PROGRAM_SCENE, m_materials[item.material],
+          item.material, item.mesh, 0);
+      continue;
+    }
+    vec4 centroid = item.world * vec4(m_meshBatches[item.mesh].centroid, 1.0f);
+    uint32_t depth = quantizeDepth(-glm::dot(viewZ, centroid), NEAR_PLANE, FAR_PLANE);
+    item.sortKey = transparentSortKey(PASS_TRANSPARENT, PROGRAM_SCENE, m_materials[item.material],
+        item.material, item.mesh, depth);
+  }
+  m_queueSorter.sort(m_transparentQueue);
 
-	glBindVertexArray(0);
-	CHECK_GL_ERRORS;
+  m_transparentSortMicros = chrono::duration<float, micro>(chrono::steady_clock::now() - start).count();
 }
 
-// only renders non-transparent objects
-void Project::renderSceneGraphRecursive(const SceneGraphShader &shader, const mat4 &parentTransform, const SceneNode &root, bool renderTransparent){
-  if (root.m_name == HIDDEN) return;
-  glm::mat4 myTrans = parentTransform * root.get_transform();
-  for (const SceneNode * node : root.children) {
-    renderSceneGraphRecursive(shader, myTrans, *node, renderTransparent);
+// Returns the index of the queue's first instance in m_instanceData. The depth
+// map program does not light anything, so shadow queues skip the normal matrix.
+size_t Project::appendInstanceData(const RenderQueue &queue, bool normals) {
+  size_t first = m_instanceData.size();
+  for (const RenderItem &item : queue) {
+    InstanceData instance;
+    instance.model = item.world;
+    instance.normal = normals ? normalMatrix(item.world) : mat3(1.0f);
+    instance.material = item.material;
+    instance.mesh = item.mesh;
+    m_instanceData.push_back(instance);
   }
+  return first;
+}
 
-  if (root.m_nodeType != NodeType::GeometryNode) return;
+//----------------------------------------------------------------------------------------
+// GL stage: submit a render queue built by buildDrawLists(), whose instance data
+// starts at m_instanceData[firstInstance]. Every run of items with the same mesh
+// and texture maps becomes one glDrawArraysInstanced. Returns the number of draw
+// calls issued.
+int Project::renderQueue(const SceneGraphShader &shader, const RenderQueue &queue, size_t firstInstance) {
+  if (queue.empty()) return 0;
+
+  glBindVertexArray(shader.m_vao);
+  m_renderState.useProgram(shader);
+
+  int drawCalls = 0;
+  for (size_t first = 0; first < queue.size();) {
+    const RenderItem &item = queue[first];
+    size_t last = first + 1;
+    const RenderMaterial &material = m_materials[item.material];
+    while (last < queue.size() && queue[last].mesh == item.mesh &&
+        m_materials[queue[last].material].textureHandle == material.textureHandle &&
+        m_materials[queue[last].material].bumpHandle == material.bumpHandle) {
+      last++;
+    }
 
-  const GeometryNode * geometryNode = static_cast<const GeometryNode *>(&root);
-  if (!renderTransparent && geometryNode->material.transparency < 1) return;
+    // Textures are shared by the whole run, materials are per instance.
+    shader.updateShaderUniforms(this, item, m_view);
+    shader.setInstanceOffset(this, m_instanceOffset + (firstInstance + first) * sizeof(InstanceData));
 
-  shader.updateShaderUniforms(this, geometryNode, myTrans, m_view);
+    const MeshBatch &batch = m_meshBatches[item.mesh];
+    glDrawElementsInstanced(GL_TRIANGLES, batch.numIndices, m_indexType,
+        (void *)(batch.firstIndex * m_indexSize), (GLsizei)(last - first));
+    m_renderState.countDraw();
 
-  // Get the BatchInfo corresponding to the GeometryNode's unique MeshId.
-  BatchInfo batchInfo = m_batchInfoMap[geometryNode->meshId];
+    drawCalls++;
+    first = last;
+  }
 
-  //-- Now render the mesh:
-  shader.enable();
-  glDrawArrays(GL_TRIANGLES, batchInfo.startIndex, batchInfo.numIndices);
-  shader.disable();
+  glBindVertexArray(0);
+  CHECK_GL_ERRORS;
+  return drawCalls;
 }
 
 
@@ -1296,7 +2126,9 @@ void Project::renderSceneGraphRecursive(const SceneGraphShader &shader, const ma
  */
 void Project::cleanup()
 {
-
+  destroyPostTargets();
+  m_lightClusters.release();
+  m_profiler.release();
 }
 
 //----------------------------------------------------------------------------------------
@@ -1323,7 +2155,12 @@ bool Project::mouseMoveEvent (
 ) {
 	bool eventHandled(false);
 
-	// Fill in with event handling code...
+	if (!ImGui::GetIO().WantCaptureMouse) {
+		Ray ray = cursorRay(xPos, yPos);
+		raycast(ray, m_cursorHit);
+		if (!m_inspecting) aimCannonAt(ray);
+		eventHandled = true;
+	}
 
 	return eventHandled;
 }
@@ -1339,7 +2176,19 @@ bool Project::mouseButtonInputEvent (
 ) {
 	bool eventHandled(false);
 
-	// Fill in with event handling code...
+	if (!ImGui::GetIO().WantCaptureMouse && button == GLFW_MOUSE_BUTTON_LEFT && actions == GLFW_PRESS) {
+		if (m_inspecting) {
+			// Select the bubble under the cursor
+			double xPos, yPos;
+			glfwGetCursorPos(m_window, &xPos, &yPos);
+			if (raycast(cursorRay(xPos, yPos), m_selectedHit) && m_selectedHit.bubble == NO_ENTITY) {
+				m_selectedHit = RayHit();
+			}
+		} else {
+			shootBubble();
+		}
+		eventHandled = true;
+	}
 
 	return eventHandled;
 }
@@ -1369,6 +2218,7 @@ bool Project::windowResizeEvent (
 ) {
 	bool eventHandled(false);
 	initPerspectiveMatrix();
+  initPostTargets();
 	return eventHandled;
 }
 
@@ -1376,11 +2226,11 @@ void Project::resetBoard() {
   if (m_inspecting) inspectReady();
 
   curTurnsUntilLower =  TURNS_UNTIL_LOWER;
-  m_cannonNode->rotate('z', 90 - m_cannonAngle);
   m_cannonAngle = 90.0f;
+  m_animator.setChannel(m_cannonNode, AnimChannel::RotateZ, 0);
 
   boardTop = STARTTOP;
-  m_topWall->setPos(vec3(0,boardTop,0));
+  m_animator.setChannel(m_topWall, AnimChannel::TranslateY, boardTop);
 
   gridHeight = START_GRID_HEIGHT;
   for (int i = 0; i < GRID_WIDTH; i++) {
@@ -1449,6 +2299,20 @@ bool Project::keyInputEvent (
       m_show_transparent = !m_show_transparent;
     }
 
+    else if (key == GLFW_KEY_7) {
+      m_weighted_transparency = !m_weighted_transparency;
+    }
+
+    else if (key == GLFW_KEY_8) {
+      m_show_point_lights = !m_show_point_lights;
+    }
+
+    else if (key == GLFW_KEY_6) {
+      // Cycle the blur history between full, half and quarter resolution.
+      m_postScale = m_postScale >= 4 ? 1 : m_postScale * 2;
+      initPostTargets();
+    }
+
     else if (key == GLFW_KEY_A) {
       m_show_blur = !m_show_blur;
       m_show_shadows = !m_show_shadows;
@@ -1471,13 +2335,13 @@ bool Project::keyInputEvent (
       loadNoiseTexture();
     }
 
-    else if (key == GLFW_KEY_L && glm::dot(m_newBubble->moveVector, vec3(1,1,1))==0) {
+    else if (key == GLFW_KEY_L && glm::dot(m_components.bodies.get(m_newBubble->m_entity).velocity, vec3(1,1,1))==0) {
       lowerTop();
     } else if (key == GLFW_KEY_C) {
       cycleTypes = !cycleTypes;
     }
 
-    else if (key == GLFW_KEY_R && glm::dot(m_newBubble->moveVector, vec3(1,1,1))==0) {
+    else if (key == GLFW_KEY_R && glm::dot(m_components.bodies.get(m_newBubble->m_entity).velocity, vec3(1,1,1))==0) {
 
       m_show_blur = 1;
       m_show_shadows = 1;
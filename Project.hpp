@@ -7,7 +7,19 @@
 
 #include "SoundManager.hpp"
 #include "SceneNode.hpp"
+#include "SceneIndex.hpp"
+#include "SceneArena.hpp"
 #include "SceneGraphShader.hpp"
+#include "FrameUniforms.hpp"
+#include "RenderState.hpp"
+#include "DrawRingBuffer.hpp"
+#include "ClusteredLights.hpp"
+#include "Headless.hpp"
+#include "FrameProfiler.hpp"
+#include "MeshBuilder.hpp"
+#include "Bvh.hpp"
+#include "WorkerPool.hpp"
+#include "Animation.hpp"
 
 #include <glm/glm.hpp>
 #include <memory>
@@ -20,13 +32,45 @@ struct LightSource {
 	glm::vec3 rgbIntensity;
 };
 
-
 class GeometryNode;
+
+// One GeometryNode instance to draw, with its world transform and bounds.
+struct DrawItem {
+  const GeometryNode *node;
+  glm::mat4 transform;
+  Aabb bounds;
+  unsigned int layers; // the node's RenderLayer bits
+};
+
+// A piece of the scene graph traversal handed to a worker: either the whole
+// subtree under node, or just node itself (its children are separate tasks).
+struct TraversalTask {
+  const SceneNode *node;
+  glm::mat4 parentTransform;
+  unsigned int parentLayers; // INHERITED_LAYERS of the ancestors
+  bool selfOnly;
+};
+
+// Nearest thing under a ray (see Project::raycast).
+struct RayHit {
+  RayHit() : node(nullptr), bubble(NO_ENTITY), distance(0), gridI(-1), gridJ(-1) {}
+
+  const SceneNode *node; // the BubbleNode or GeometryNode hit, null on a miss
+  EntityId bubble;       // entity of the bubble hit, NO_ENTITY otherwise
+  float distance;        // along the ray
+  glm::vec3 point;       // world space
+  int gridI, gridJ;      // board cell under the hit
+};
+
 class Project : public CS488Window {
 public:
 	Project(const std::string & luaSceneFile);
 	virtual ~Project();
 
+  // Run options.frames frames without a window, in the current (headless)
+  // context. Defined in Headless.cpp.
+  int runHeadless(const HeadlessOptions &options);
+
 protected:
 	virtual void init() override;
 	virtual void appLogic() override;
@@ -46,32 +90,38 @@ protected:
 	void processLuaSceneFile(const std::string & filename);
   void enableVertexShaderInputSlots();
   void setTextureMaps();
-  void initWindowFBO(GLuint *fbo, GLuint *tex);
+  void initWindowFBO(GLuint *fbo, GLuint *tex, int width, int height, GLint filter);
 	void mapVboDataToVertexShaderInputLocations();
   void createShader(ShaderProgram &program, const std::string &vs, const std::string &fs);
 
-	void uploadVertexDataToVbos(const MeshConsolidator & meshConsolidator);
+	void uploadVertexDataToVbos(const IndexedMeshes & meshes, const PackedVertices & vertices);
 	void initViewMatrix();
 	void updateLightSources();
 
 	void initPerspectiveMatrix();
 	void uploadCommonSceneUniforms();
-	void renderSceneGraph(const SceneGraphShader &shader,const SceneNode &node, bool renderTransparent = false);
-  void renderSceneGraphRecursive(const SceneGraphShader &shader, const glm::mat4 &parentTransform, const SceneNode &root, bool renderTransparent);
+	void cacheUniformLocations();
+	int renderQueue(const SceneGraphShader &shader, const RenderQueue &queue, size_t firstInstance);
 
-  void renderTransparentNodes(const SceneGraphShader &shader, const SceneNode &root);
+  void renderTransparentNodes(const SceneGraphShader &shader);
+  void renderWeightedTransparentNodes(const SceneGraphShader &shader);
 	void renderArcCircle();
 
 
   void loadTextures();
   void loadTexture(const std::string &texture, char *defaultData);
-  void loadTexturesFromList(std::set<std::string> &textures, std::map<std::string, GLuint> &nameMap, std::vector<GLuint>, char *defaultData);
+  void loadTexturesFromList(std::set<std::string> &textures, std::map<std::string, int> &nameMap, std::vector<GLuint> &texs, char *defaultData);
+  void resolveRenderHandles();
 
 public:
   
-  std::map<std::string, GLuint> m_bumpNameIdMap;
+  // Name -> handle (index into m_bumps)
+  std::map<std::string, int> m_bumpNameIdMap;
   std::vector<GLuint> m_bumps;
 
+  // Handle -> material and texture maps (see GeometryNode::materialHandle)
+  std::vector<RenderMaterial> m_materials;
+
   static const int MAX_FRAME = 360;
   int m_frame;
 	glm::mat4 m_perpsective;
@@ -80,60 +130,175 @@ public:
 
 	LightSource m_light;
 
+  // Many small lights on top of m_light: a glow per bubble and a flash per
+  // popped bubble, assigned to clusters by buildDrawLists().
+  struct PopFlash {
+    glm::vec3 position; // board space
+    glm::vec3 colour;
+    int age;            // frames
+  };
+  std::vector<PopFlash> m_popFlashes;
+  std::vector<glm::vec3> m_bubbleGlowColours; // by bubble type
+  std::vector<PointLight> m_pointLights;
+  ClusteredLights m_lightClusters;
+  void updatePointLights();
+  void addPopFlash(int i, int j);
+
 	//-- GL resources for mesh geometry data:
 	GLuint m_vao_meshData;
-	GLuint m_vbo_vertexPositions;
-	GLuint m_vbo_vertexNormals;
-	GLuint m_vbo_vertexUVs;
+	GLuint m_vbo_vertices;   // packed, interleaved vertex data
+	VertexLayout m_vertexLayout;
+	GLuint m_ibo_indices;
+	GLenum m_indexType;      // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	size_t m_indexSize;
 	GLint m_positionAttribLocation;
 	GLint m_normalAttribLocation;
 	GLint m_uvAttribLocation;
 	SceneGraphShader *m_shader;
 
-  std::map<std::string, GLuint> m_textureNameIdMap;
+  // Name -> handle (index into m_textures)
+  std::map<std::string, int> m_textureNameIdMap;
   std::vector<GLuint> m_textures;
 
   GLuint m_fbo_depthMap;
   GLuint m_vao_depthData;
   GLuint m_depthPositionAttribLocation;
   GLuint m_depthMap;
-  void initDepthMapFBO();
+  void initDepthMapFBO(GLuint *fbo, GLuint *depthMap);
+
+  // Shadow casters without LAYER_DYNAMIC are drawn into m_staticDepthMap only
+  // when m_staticShadowKey (the light and every static caster) changes. Each
+  // frame copies it into m_depthMap and adds the dynamic casters on top.
+  GLuint m_fbo_staticDepthMap;
+  GLuint m_staticDepthMap;
+  uint64_t m_staticShadowKey;
+  uint64_t m_cachedStaticShadowKey;
+  bool m_staticShadowValid;
+  int m_staticShadowRenders;
   SceneGraphShader *m_depthMapShader;
 
+  // Per draw data. The model matrix and material index of every queued item
+  // are staged in m_instanceData and streamed through m_drawRing once per
+  // frame, at m_instanceOffset. Shaders read them as instanced attributes and
+  // look the material up in m_ubo_materials, so each run of items sharing a
+  // mesh and texture maps is a single instanced draw.
+  DrawRingBuffer m_drawRing;
+  std::vector<InstanceData> m_instanceData;
+  size_t m_instanceOffset;
+  size_t m_staticShadowInstances, m_dynamicShadowInstances;
+  size_t m_opaqueInstances, m_transparentInstances, m_uiInstances;
+  size_t appendInstanceData(const RenderQueue &queue, bool normals);
+  GLuint m_ubo_materials;
+  void uploadMaterialTable();
+  GLuint m_ubo_meshes;
+  void uploadMeshTable();
+  int m_shadowDrawCalls;
+  int m_opaqueDrawCalls;
+
+  // Program and texture bindings of the scene passes, reset every frame.
+  RenderState m_renderState;
+
   GLuint m_noiseTexture;
   void loadNoiseTexture();
 
   glm::mat4 m_lightSpaceMatrix;
 
-  GLuint m_vbo_vertexTangents;
+  // Uniform buffer holding m_frameUniforms, shared by the scene, depth map and
+  // skybox programs.
+  FrameUniforms m_frameUniforms;
+  GLuint m_ubo_frame;
+
   GLuint m_tangentAttribLocation;
 
   GLuint m_normalMap;
 
-  GLuint m_fbo_blurredScreen;
-  GLuint m_blurredScreen;
+  // The scene is drawn at full resolution into m_lastScreen. The blur history
+  // ping-pongs between two targets at 1/m_postScale of the window size; each
+  // frame blends the scene over m_history[m_historyIndex] into the other one,
+  // and a single composite pass draws to the back buffer.
   GLuint m_fbo_lastScreen;
   GLuint m_lastScreen;
+  GLuint m_rbo_lastScreenDepth;
+  GLuint m_fbo_history[2];
+  GLuint m_history[2];
+  int m_historyIndex;
+  bool m_historyValid;
+  int m_postScale;
+  int m_postWidth;
+  int m_postHeight;
+  // Weighted blended order independent transparency: transparent draws add
+  // into m_oitAccum (premultiplied colour times weight, revealage in alpha)
+  // and m_oitWeight, which m_oitCompositeShader then blends over the scene.
+  GLuint m_fbo_oit;
+  GLuint m_oitAccum;
+  GLuint m_oitWeight;
+  ShaderProgram m_oitCompositeShader;
+  GLint m_weightedPassLocation;
   GLuint m_vao_screen;
+  bool m_headless;
+  GLuint m_fbo_output; // the post chain's final target, 0 for the window
+  GLuint m_outputTexture;
   
   ShaderProgram m_screenShader;
+  GLint m_screenDoBlurLocation;
   GLuint m_aPosAttribLocation;
   GLuint m_aTexCoordsAttribLocation;
   GLuint m_vbo_screenData;
   
-  void initBlurFBO();
+  void initPostTargets();
+  void destroyPostTargets();
+  void renderPostChain();
 
 	// BatchInfoMap is an associative container that maps a unique MeshId to a BatchInfo
 	// object. Each BatchInfo object contains an index offset and the number of indices
 	// required to render the mesh with identifier MeshId.
 	BatchInfoMap m_batchInfoMap;
 
+  // Index buffer ranges of the welded meshes, by name and per mesh handle
+  // (GeometryNode::meshHandle). m_meshBatches is filled by resolveRenderHandles().
+  std::map<std::string, MeshBatch> m_meshBatchMap;
+  std::vector<MeshBatch> m_meshBatches;
+  std::map<std::string, int> m_meshNameIdMap;
+
+  // Model space bounds per mesh, by name and by mesh handle.
+  std::map<std::string, Aabb> m_meshBoundsMap;
+  std::vector<Aabb> m_meshBounds;
+  void computeMeshBounds(const MeshConsolidator &meshConsolidator);
+
+  // Scene traversal is split in two stages. buildDrawLists() is the CPU stage:
+  // workers compute world transforms and bounds for chunks of the graph, the
+  // results are culled through m_bvh (one leaf per DrawItem) and extracted
+  // once into a render queue per pass. renderQueue() then only submits GL
+  // calls on the main thread.
+  WorkerPool m_workerPool;
+  std::vector<TraversalTask> m_traversalTasks;
+  std::vector<std::vector<DrawItem>> m_taskDrawItems;
+  std::vector<DrawItem> m_drawItems;
+  std::vector<const GeometryNode *> m_bvhNodes;
+  Bvh m_bvh;
+  std::vector<char> m_cameraVisible;
+  std::vector<char> m_lightVisible;
+  RenderQueue m_staticShadowQueue;  // sorted by opaqueSortKey
+  RenderQueue m_dynamicShadowQueue; // sorted by opaqueSortKey
+  RenderQueue m_opaqueQueue;      // sorted by opaqueSortKey
+  RenderQueue m_transparentQueue; // sorted by transparentSortKey
+  RenderQueue m_uiQueue;          // traversal order
+  RenderQueueSorter m_queueSorter;
+  FrameProfiler m_profiler; // CPU and GPU time of each stage of draw()
+  float m_transparentSortMicros;  // last sortTransparentQueue()
+  void buildDrawLists();
+  void sortTransparentQueue();
+  void splitTraversal(const SceneNode &root, size_t targetTasks);
+  void collectDrawItems(const SceneNode &root, const glm::mat4 &parentTransform, unsigned int parentLayers, bool selfOnly, std::vector<DrawItem> &items) const;
+
 	std::string m_luaSceneFile;
 
 	SceneNode *m_rootNode;
-  void collectTransparentNodesRecursive(const SceneNode &root, const glm::mat4 &parentTransform, std::vector<std::pair<const GeometryNode *, glm::mat4> > &transparentNodes);
+  SceneIndex m_sceneIndex;
+  SceneArena m_sceneArena; // owns every node of the loaded scene
+  void unloadScene();
 
-  void hookControls(std::vector<SceneNode *> &nodes);
+  void hookControls(const SceneIndex &index);
   
   GeometryNode * m_topWall;
   BubbleNode*  m_newBubble;
@@ -141,8 +306,25 @@ public:
   float m_cannonAngle;
   SceneNode * m_cannonNode;
 
+  // Drives the bubble type spin and the cannon rotation.
+  Animator m_animator;
+  void initAnimations();
+
   SceneNode * m_bubblesHolder;
+  std::vector<SceneNode *> m_bubblesHolderPath; // root to m_bubblesHolder
+  glm::mat4 bubblesHolderInverse() const;
   void rotateCannon(int dir);
+  void setCannonAngle(float angle);
+
+  // Picking. raycast tests bubbles exactly against their collision spheres and
+  // the rest of the scene against the bounding spheres of last frame's draw
+  // items, through the BVH. Bubbles take precedence.
+  Ray cursorRay(double xPos, double yPos) const;
+  bool raycast(const Ray &ray, RayHit &hit) const;
+  void aimCannonAt(const Ray &ray);
+  mutable std::vector<size_t> m_rayLeaves;
+  RayHit m_cursorHit;   // under the cursor
+  RayHit m_selectedHit; // last clicked while inspecting
 
   void tickGameLogic();
   void tickBubbleMovement();
@@ -160,13 +342,19 @@ public:
   void shootBubble();
   void removeBubble(int i, int j);
 
-  std::set<BubbleNode *> m_fixedBubbles;
+  // Bubble positions, physics and colours. Every bubble except m_newBubble is
+  // fixed in bubbleGrid.
+  SceneComponents m_components;
+  BubbleNode * spawnBubble(const glm::vec3 &pos, size_t type);
+  void destroyBubble(BubbleNode *bubble);
+  void tickPhysics();
 
   SoundManager m_soundManager;
   
   void inspectReady();
   bool m_inspecting;
   ShaderProgram m_skyboxShader;
+  GLint m_skyboxModelLocation;
   GLuint m_vao_skybox;
   GLuint m_vbo_skybox;
   GLuint m_skybox;
@@ -178,6 +366,8 @@ public:
   bool m_show_shadows;
   bool m_show_blur;
   bool m_show_transparent;
+  bool m_weighted_transparency; // OIT instead of sorted blending
+  bool m_show_point_lights;
 
   void resetBoard();
 
@@ -0,0 +1,83 @@
+#include "RenderQueue.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+static const uint64_t FIELD_MASK = 0x3ff; // 10 bit key fields
+
+//---------------------------------------------------------------------------------------
+uint32_t quantizeDepth(float depth, float zNear, float zFar) {
+  static const uint32_t MAX_DEPTH = (1u << SORT_KEY_DEPTH_BITS) - 1;
+  float t = (depth - zNear) / (zFar - zNear);
+  t = std::min(std::max(t, 0.0f), 1.0f);
+  return (uint32_t)(t * MAX_DEPTH);
+}
+
+static uint64_t stateBits(const RenderMaterial &material, int materialHandle, int mesh) {
+  return (((uint64_t)material.textureHandle & FIELD_MASK) << 30)
+       | (((uint64_t)material.bumpHandle & FIELD_MASK) << 20)
+       | (((uint64_t)mesh & FIELD_MASK) << 10)
+       | ((uint64_t)materialHandle & FIELD_MASK);
+}
+
+static uint64_t headerBits(RenderPass pass, RenderProgram program) {
+  return ((uint64_t)(pass & 3) << 62) | ((uint64_t)(program & 3) << 60);
+}
+
+uint64_t opaqueSortKey(RenderPass pass, RenderProgram program,
+    const RenderMaterial &material, int materialHandle, int mesh, uint32_t depth) {
+  return headerBits(pass, program)
+       | (stateBits(material, materialHandle, mesh) << SORT_KEY_DEPTH_BITS)
+       | depth;
+}
+
+uint64_t transparentSortKey(RenderPass pass, RenderProgram program,
+    const RenderMaterial &material, int materialHandle, int mesh, uint32_t depth) {
+  uint32_t farDepth = ((1u << SORT_KEY_DEPTH_BITS) - 1) - depth;
+  return headerBits(pass, program)
+       | ((uint64_t)farDepth << 40)
+       | stateBits(material, materialHandle, mesh);
+}
+
+//---------------------------------------------------------------------------------------
+void radixSort(std::vector<SortEntry> &entries, std::vector<SortEntry> &scratch) {
+  const size_t n = entries.size();
+  if (n < 2) return;
+  scratch.resize(n);
+
+  for (int shift = 0; shift < 64; shift += 8) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < n; i++) {
+      counts[(entries[i].key >> shift) & 0xff]++;
+    }
+    if (counts[(entries[0].key >> shift) & 0xff] == n) continue;
+
+    size_t offset = 0;
+    for (int d = 0; d < 256; d++) {
+      size_t count = counts[d];
+      counts[d] = offset;
+      offset += count;
+    }
+    for (size_t i = 0; i < n; i++) {
+      scratch[counts[(entries[i].key >> shift) & 0xff]++] = entries[i];
+    }
+    entries.swap(scratch);
+  }
+}
+
+//---------------------------------------------------------------------------------------
+void RenderQueueSorter::sort(RenderQueue &queue) {
+  entries.resize(queue.size());
+  for (size_t i = 0; i < queue.size(); i++) {
+    entries[i].key = queue[i].sortKey;
+    entries[i].index = (uint32_t)i;
+  }
+  radixSort(entries, scratch);
+
+  sorted.resize(queue.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    sorted[i] = queue[entries[i].index];
+  }
+  queue.swap(sorted);
+}
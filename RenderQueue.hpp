@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Material.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+class GeometryNode;
+
+// A GeometryNode's material and texture maps. Nodes with identical settings
+// share one entry (see Project::resolveRenderHandles).
+struct RenderMaterial {
+  Material material;
+  int textureHandle; // index into Project::m_textures
+  int bumpHandle;    // index into Project::m_bumps
+};
+
+// One draw call, extracted from the scene graph once per frame and consumed by
+// every pass that draws it.
+struct RenderItem {
+  glm::mat4 world;
+  int mesh;         // index into Project::m_meshBatches
+  int material;     // index into Project::m_materials
+  uint64_t sortKey; // queues are drawn in increasing key order
+  const GeometryNode *node;
+};
+
+typedef std::vector<RenderItem> RenderQueue;
+
+enum RenderPass { PASS_SHADOW, PASS_OPAQUE, PASS_TRANSPARENT, PASS_UI };
+enum RenderProgram { PROGRAM_SCENE, PROGRAM_DEPTH_MAP };
+
+// Draw order keys, most significant field first:
+//   opaque:       pass:2 program:2 texture:10 bump:10 mesh:10 material:10 depth:20
+//   transparent:  pass:2 program:2 far-depth:20 texture:10 bump:10 mesh:10 material:10
+// Opaque draws are grouped by state and then go front to back, so runs of one
+// mesh and texture maps stay together for instancing. Transparent draws go back
+// to front and only use state to break ties.
+static const int SORT_KEY_DEPTH_BITS = 20;
+
+// Map a view space depth in [zNear, zFar] to SORT_KEY_DEPTH_BITS bits.
+uint32_t quantizeDepth(float depth, float zNear, float zFar);
+
+uint64_t opaqueSortKey(RenderPass pass, RenderProgram program,
+    const RenderMaterial &material, int materialHandle, int mesh, uint32_t depth);
+uint64_t transparentSortKey(RenderPass pass, RenderProgram program,
+    const RenderMaterial &material, int materialHandle, int mesh, uint32_t depth);
+
+struct SortEntry {
+  uint64_t key;
+  uint32_t index;
+};
+
+// LSD radix sort by key, 8 bits at a time. Stable; digits that are the same
+// for every entry are skipped. scratch is resized as needed.
+void radixSort(std::vector<SortEntry> &entries, std::vector<SortEntry> &scratch);
+
+// Reorder queue by RenderItem::sortKey using radixSort.
+struct RenderQueueSorter {
+  std::vector<SortEntry> entries;
+  std::vector<SortEntry> scratch;
+  RenderQueue sorted;
+
+  void sort(RenderQueue &queue);
+};
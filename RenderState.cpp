@@ -0,0 +1,34 @@
+#include "RenderState.hpp"
+
+//---------------------------------------------------------------------------------------
+RenderState::RenderState() {
+  beginFrame();
+}
+
+// No real object has the name -1, so the next bind of anything goes through.
+void RenderState::invalidate() {
+  m_program = (GLuint)-1;
+  for (int i = 0; i < NUM_TEXTURE_UNITS; i++) m_textures[i] = (GLuint)-1;
+}
+
+void RenderState::beginFrame() {
+  invalidate();
+  m_counters = Counters{0, 0, 0};
+}
+
+//---------------------------------------------------------------------------------------
+void RenderState::useProgram(const ShaderProgram &program) {
+  GLuint object = program.getProgramObject();
+  if (m_program == object) return;
+  program.enable();
+  m_program = object;
+  m_counters.programChanges++;
+}
+
+void RenderState::bindTexture(int unit, GLuint texture) {
+  if (m_textures[unit] == texture) return;
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  m_textures[unit] = texture;
+  m_counters.textureChanges++;
+}
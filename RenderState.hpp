@@ -0,0 +1,36 @@
+#pragma once
+
+#include "cs488-framework/OpenGLImport.hpp"
+#include "cs488-framework/ShaderProgram.hpp"
+
+// The program and 2D textures bound while submitting render queues, so that
+// binding what is already bound costs nothing. Counts the changes it makes.
+class RenderState {
+public:
+  static const int NUM_TEXTURE_UNITS = 3;
+
+  struct Counters {
+    int programChanges;
+    int textureChanges;
+    int drawCalls;
+  };
+
+  RenderState();
+
+  // Forget what is bound, e.g. after other code bound programs or textures
+  // directly. Counters are kept.
+  void invalidate();
+  // Start a new frame: invalidate() and zero the counters.
+  void beginFrame();
+
+  void useProgram(const ShaderProgram &program);
+  void bindTexture(int unit, GLuint texture);
+  void countDraw() { m_counters.drawCalls++; }
+
+  const Counters & counters() const { return m_counters; }
+
+private:
+  GLuint m_program;
+  GLuint m_textures[NUM_TEXTURE_UNITS];
+  Counters m_counters;
+};
@@ -0,0 +1,76 @@
+#include "SceneArena.hpp"
+
+#include "GeometryNode.hpp"
+#include "JointNode.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+//---------------------------------------------------------------------------------------
+SceneArena::~SceneArena() {
+  release();
+}
+
+//---------------------------------------------------------------------------------------
+SceneNode * SceneArena::newSceneNode(const std::string & name) {
+  return create<SceneNode>(name);
+}
+
+GeometryNode * SceneArena::newGeometryNode(const std::string & meshId, const std::string & name) {
+  return create<GeometryNode>(meshId, name);
+}
+
+JointNode * SceneArena::newJointNode(const std::string & name) {
+  return create<JointNode>(name);
+}
+
+Material * SceneArena::newMaterial() {
+  return create<Material>();
+}
+
+//---------------------------------------------------------------------------------------
+void * SceneArena::allocate(size_t size, size_t align) {
+  while (m_block < m_blocks.size()) {
+    Block &block = m_blocks[m_block];
+    uintptr_t base = (uintptr_t)block.data.get();
+    size_t offset = ((base + m_used + align - 1) & ~(uintptr_t)(align - 1)) - base;
+    if (offset + size <= block.size) {
+      m_used = offset + size;
+      return block.data.get() + offset;
+    }
+    m_block++;
+    m_used = 0;
+  }
+
+  Block block;
+  block.size = std::max((size_t)BLOCK_SIZE, size + align);
+  block.data.reset(new char[block.size]);
+  m_blocks.push_back(std::move(block));
+  return allocate(size, align);
+}
+
+//---------------------------------------------------------------------------------------
+void SceneArena::release() {
+  // Nodes would otherwise delete their children from ~SceneNode, so detach
+  // everything first and then destroy each object once.
+  for (const Object &object : m_objects) {
+    if (object.node) object.node->children.clear();
+  }
+  for (size_t i = m_objects.size(); i-- > 0;) {
+    m_objects[i].destroy(m_objects[i].ptr);
+  }
+  m_objects.clear();
+  m_block = 0;
+  m_used = 0;
+}
+
+//---------------------------------------------------------------------------------------
+size_t SceneArena::bytesUsed() const {
+  size_t bytes = m_used;
+  for (size_t i = 0; i < m_block && i < m_blocks.size(); i++) {
+    bytes += m_blocks[i].size;
+  }
+  return bytes;
+}
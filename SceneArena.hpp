@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class SceneNode;
+class GeometryNode;
+class JointNode;
+struct Material;
+
+// Owns every node and material created while importing one scene. Objects are
+// placed back to back in large blocks and are all destroyed together by
+// release(), which keeps the blocks to be reused by the next import.
+//
+// Nodes in an arena never delete their children; the arena destroys each of
+// them exactly once, so shared (DAG) children are fine.
+class SceneArena {
+public:
+  SceneArena() : m_block(0), m_used(0) {}
+  ~SceneArena();
+
+  SceneNode * newSceneNode(const std::string & name);
+  GeometryNode * newGeometryNode(const std::string & meshId, const std::string & name);
+  JointNode * newJointNode(const std::string & name);
+  Material * newMaterial();
+
+  // Destroy everything created since the last release.
+  void release();
+
+  size_t numObjects() const { return m_objects.size(); }
+  size_t bytesUsed() const;
+
+private:
+  static const size_t BLOCK_SIZE = 64 * 1024;
+
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  struct Object {
+    void *ptr;
+    void (*destroy)(void *);
+    SceneNode *node; // ptr as a node, or null
+  };
+
+  void * allocate(size_t size, size_t align);
+
+  template <typename T, typename... Args>
+  T * create(Args &&... args) {
+    T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value) {
+      m_objects.push_back(Object{object, &destroyObject<T>, asNode(object)});
+    }
+    return object;
+  }
+
+  static SceneNode * asNode(SceneNode *node) { return node; }
+  static SceneNode * asNode(void *) { return nullptr; }
+
+  template <typename T>
+  static void destroyObject(void *ptr) {
+    static_cast<T *>(ptr)->~T();
+  }
+
+  std::vector<Block> m_blocks;
+  size_t m_block; // block currently being filled
+  size_t m_used;  // bytes used in it
+  std::vector<Object> m_objects; // in creation order
+};
@@ -3,6 +3,7 @@
 #include "Project.hpp"
 #include <glm/gtc/type_ptr.hpp>
 #include "GeometryNode.hpp"
+#include "ClusteredLights.hpp"
 #include <iostream>
 
 using namespace std;
@@ -12,11 +13,36 @@ SceneGraphShader::SceneGraphShader() {
   glGenVertexArrays(1, &m_vao);
 }
 
+// Model is a mat4, which takes four consecutive locations, one per column.
+void SceneGraphShader::enableInstanceSlots() {
+  m_modelAttribLocation = getAttribLocation("Model");
+  for (int i = 0; i < 4; i++) {
+    glEnableVertexAttribArray(m_modelAttribLocation + i);
+    glVertexAttribDivisor(m_modelAttribLocation + i, 1);
+  }
+  m_meshAttribLocation = getAttribLocation("meshIndex");
+  glEnableVertexAttribArray(m_meshAttribLocation);
+  glVertexAttribDivisor(m_meshAttribLocation, 1);
+}
+
+void SceneGraphShader::setInstanceOffset(Project *project, size_t offset) const {
+  glBindBuffer(GL_ARRAY_BUFFER, project->m_drawRing.buffer());
+  for (int i = 0; i < 4; i++) {
+    size_t column = offset + offsetof(InstanceData, model) + i * sizeof(vec4);
+    glVertexAttribPointer(m_modelAttribLocation + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void *)column);
+  }
+  glVertexAttribIPointer(m_meshAttribLocation, 1, GL_INT, sizeof(InstanceData),
+      (void *)(offset + offsetof(InstanceData, mesh)));
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 void DepthMapShader::enableVertexShaderInputSlots() {
   glBindVertexArray(m_vao);
   // Enable the vertex shader attribute location for "position" when rendering.
   m_positionAttribLocation = getAttribLocation("position");
   glEnableVertexAttribArray(m_positionAttribLocation);
+
+  enableInstanceSlots();
   
   CHECK_GL_ERRORS;
   glBindVertexArray(0);
@@ -24,8 +50,13 @@ void DepthMapShader::enableVertexShaderInputSlots() {
 
 void DepthMapShader::mapVboDataToVertexShaderInputs(Project *project) {
   glBindVertexArray(m_vao);
-  glBindBuffer(GL_ARRAY_BUFFER, project->m_vbo_vertexPositions);
-  glVertexAttribPointer(m_positionAttribLocation, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+  const VertexLayout &layout = project->m_vertexLayout;
+  glBindBuffer(GL_ARRAY_BUFFER, project->m_vbo_vertices);
+  glVertexAttribPointer(m_positionAttribLocation, 3, layout.positionType, GL_TRUE, layout.stride,
+      (void *)layout.positionOffset);
+  // The element buffer binding is part of the VAO.
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, project->m_ibo_indices);
+  setInstanceOffset(project, 0);
   
   //-- Unbind target, and restore default values:
   glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -34,23 +65,10 @@ void DepthMapShader::mapVboDataToVertexShaderInputs(Project *project) {
   CHECK_GL_ERRORS;
 }
 
-void DepthMapShader::uploadCommonSceneUniforms(Project *project) {
-  enable();
-  GLint location = getUniformLocation("LightSpaceMatrix");
-  glUniformMatrix4fv(location,1,GL_FALSE, value_ptr(project->m_lightSpaceMatrix));
-  CHECK_GL_ERRORS;
-  disable();
-}
-
+// Everything per draw comes from the instance data.
 void DepthMapShader::updateShaderUniforms(Project *project,
-    const GeometryNode *node,
-		const glm::mat4 & nodeTrans,
+    const RenderItem &item,
 		const glm::mat4 & viewMatrix) const {
-  enable();
-  GLint location = getUniformLocation("Model");
-  glUniformMatrix4fv(location, 1, GL_FALSE, value_ptr(nodeTrans));
-  CHECK_GL_ERRORS;
-  disable();
 }
 
 void SceneShader::enableVertexShaderInputSlots() {
@@ -78,6 +96,19 @@ void SceneShader::enableVertexShaderInputSlots() {
   m_tangentAttribLocation = getAttribLocation("aTangent");
   glEnableVertexAttribArray(m_tangentAttribLocation);
 
+  CHECK_GL_ERRORS;
+
+  enableInstanceSlots();
+  m_materialAttribLocation = getAttribLocation("materialIndex");
+  glEnableVertexAttribArray(m_materialAttribLocation);
+  glVertexAttribDivisor(m_materialAttribLocation, 1);
+  // NormalMatrix is a mat3, three locations like Model's columns.
+  m_normalMatrixAttribLocation = getAttribLocation("NormalMatrix");
+  for (int i = 0; i < 3; i++) {
+    glEnableVertexAttribArray(m_normalMatrixAttribLocation + i);
+    glVertexAttribDivisor(m_normalMatrixAttribLocation + i, 1);
+  }
+
   CHECK_GL_ERRORS;
   glBindVertexArray(0);
 }
@@ -87,27 +118,25 @@ void SceneShader::mapVboDataToVertexShaderInputs(Project *project) {
   glBindVertexArray(m_vao);
 
   CHECK_GL_ERRORS;
-  // Tell GL how to map data from the vertex buffer "m_vbo_vertexPositions" into the
-  // "position" vertex attribute location for any bound vertex shader program.
-  glBindBuffer(GL_ARRAY_BUFFER, project->m_vbo_vertexPositions);
-  CHECK_GL_ERRORS;
-  glVertexAttribPointer(m_positionAttribLocation, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
-  
+  // Tell GL how to map the packed, interleaved data in "m_vbo_vertices" into
+  // the vertex attribute locations for any bound vertex shader program. GL
+  // expands the packed formats; positions are scaled back in the shader.
+  const VertexLayout &layout = project->m_vertexLayout;
+  glBindBuffer(GL_ARRAY_BUFFER, project->m_vbo_vertices);
   CHECK_GL_ERRORS;
-  // Tell GL how to map data from the vertex buffer "m_vbo_vertexNormals" into the
-  // "normal" vertex attribute location for any bound vertex shader program.
-  glBindBuffer(GL_ARRAY_BUFFER, project->m_vbo_vertexNormals);
-  glVertexAttribPointer(m_normalAttribLocation, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+  glVertexAttribPointer(m_positionAttribLocation, 3, layout.positionType, GL_TRUE, layout.stride,
+      (void *)layout.positionOffset);
+  glVertexAttribPointer(m_normalAttribLocation, 4, GL_INT_2_10_10_10_REV, GL_TRUE, layout.stride,
+      (void *)layout.normalOffset);
+  glVertexAttribPointer(m_uvAttribLocation, 2, GL_HALF_FLOAT, GL_FALSE, layout.stride,
+      (void *)layout.uvOffset);
+  glVertexAttribPointer(m_tangentAttribLocation, 4, GL_INT_2_10_10_10_REV, GL_TRUE, layout.stride,
+      (void *)layout.tangentOffset);
 
   CHECK_GL_ERRORS;
-  // Tell GL how to map data from the vertex buffer "m_vbo_vertexUVs" into the
-  // "uv" vertex attribute location for any bound vertex shader program.
-  glBindBuffer(GL_ARRAY_BUFFER, project->m_vbo_vertexUVs);
-  glVertexAttribPointer(m_uvAttribLocation, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
-
-  CHECK_GL_ERRORS;
-  glBindBuffer(GL_ARRAY_BUFFER, project->m_vbo_vertexTangents);
-  glVertexAttribPointer(m_tangentAttribLocation, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+  // The element buffer binding is part of the VAO.
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, project->m_ibo_indices);
+  setInstanceOffset(project, 0);
 
   CHECK_GL_ERRORS;
   //-- Unbind target, and restore default values:
@@ -117,97 +146,16 @@ void SceneShader::mapVboDataToVertexShaderInputs(Project *project) {
   CHECK_GL_ERRORS;
 }
 
-void SceneShader::uploadCommonSceneUniforms(Project *project) {
-  enable();
-  //-- Set Perpsective matrix uniform for the scene:
-  GLint location = getUniformLocation("Perspective");
-  glUniformMatrix4fv(location, 1, GL_FALSE, value_ptr(project->m_perpsective));
-  CHECK_GL_ERRORS;
-  
-  location = getUniformLocation("showShadows");
-  glUniform1i(location, project->m_show_shadows);
-
-  {
-    location = getUniformLocation("viewPos");
-    glUniform3fv(location, 1, value_ptr(project->m_viewPos));
-  }
-
-  //-- Set LightSource uniform for the scene:
-  {
-    location = getUniformLocation("light.position");
-    glUniform3fv(location, 1, value_ptr(project->m_light.position));
-    location = getUniformLocation("light.rgbIntensity");
-    glUniform3fv(location, 1, value_ptr(project->m_light.rgbIntensity));
-    CHECK_GL_ERRORS;
-  }
-
-  //-- Set background light ambient intensity
-  {
-    location = getUniformLocation("ambientIntensity");
-    vec3 ambientIntensity(0.1f);
-    glUniform3fv(location, 1, value_ptr(ambientIntensity));
-    CHECK_GL_ERRORS;
-  }
-
-  //-- 
-  {
-    location = getUniformLocation("LightSpaceMatrix");
-    glUniformMatrix4fv(location, 1, GL_FALSE, value_ptr(project->m_lightSpaceMatrix));
-    CHECK_GL_ERRORS;
-  }
-
-  disable();
-}
+// View, projection, lighting and the toggles come from the FrameUniforms block,
+// the model matrix and material index from the instance data and the material
+// itself from the Materials block.
 void SceneShader::updateShaderUniforms(Project *project,
-    const GeometryNode *node,
-		const glm::mat4 & nodeTrans,
+    const RenderItem &item,
 		const glm::mat4 & viewMatrix) const {
-  enable();
-  //-- Set ModelView matrix:
-  GLint location = getUniformLocation("View");
-  glUniformMatrix4fv(location, 1, GL_FALSE, value_ptr(viewMatrix));
-  CHECK_GL_ERRORS;
-
-  location = getUniformLocation("Model");
-  glUniformMatrix4fv(location, 1, GL_FALSE, value_ptr(nodeTrans));
-  CHECK_GL_ERRORS;
-
-
-  //-- Set Material values:
-  location = getUniformLocation("material.kd");
-  vec3 kd = node->material.kd;
-  glUniform3fv(location, 1, value_ptr(kd));
-  CHECK_GL_ERRORS;
-  location = getUniformLocation("material.ks");
-  vec3 ks = node->material.ks;
-  glUniform3fv(location, 1, value_ptr(ks));
-  CHECK_GL_ERRORS;
-  location = getUniformLocation("material.shininess");
-  glUniform1f(location, node->material.shininess);
-  CHECK_GL_ERRORS;
-  location = getUniformLocation("material.transparency");
-  glUniform1f(location, (!project->m_show_transparent) ? 1.0 : node->material.transparency);
-  CHECK_GL_ERRORS;
-  location = getUniformLocation("showTextures");
-  glUniform1i(location, project->m_show_textures);
-
-  disable();
-
-  glActiveTexture(GL_TEXTURE0);
-  if (!project->m_show_textures) {
-    glBindTexture(GL_TEXTURE_2D, 0);
-  } else if (node->texture == "~perlin") {
-    glBindTexture(GL_TEXTURE_2D, project->m_noiseTexture);
-  } else {
-    glBindTexture(GL_TEXTURE_2D, project->m_textureNameIdMap[node->texture]);
-  }
-
-  glActiveTexture(GL_TEXTURE1);
-  if (!project->m_show_bump) {
-    glBindTexture(GL_TEXTURE_2D, 0);
-  } else {
-    glBindTexture(GL_TEXTURE_2D, project->m_bumpNameIdMap[node->bumpMap]);
-  }
+  const RenderMaterial &material = project->m_materials[item.material];
+  RenderState &state = project->m_renderState;
+  state.bindTexture(0, project->m_show_textures ? project->m_textures[material.textureHandle] : 0);
+  state.bindTexture(1, project->m_show_bump ? project->m_bumps[material.bumpHandle] : 0);
 }
 
 void SceneShader::setTextureMaps() {
@@ -218,5 +166,21 @@ void SceneShader::setTextureMaps() {
   glUniform1i(location, 1);
   location = getUniformLocation("shadowMap");
   glUniform1i(location, 2);
+  glUniform1i(getUniformLocation("lightData"), LIGHTS_TEXTURE_UNIT);
+  glUniform1i(getUniformLocation("clusterData"), CLUSTERS_TEXTURE_UNIT);
+  glUniform1i(getUniformLocation("lightIndices"), LIGHT_INDICES_TEXTURE_UNIT);
   disable();
 }
+
+
+void SceneShader::setInstanceOffset(Project *project, size_t offset) const {
+  SceneGraphShader::setInstanceOffset(project, offset);
+  glBindBuffer(GL_ARRAY_BUFFER, project->m_drawRing.buffer());
+  glVertexAttribIPointer(m_materialAttribLocation, 1, GL_INT, sizeof(InstanceData),
+      (void *)(offset + offsetof(InstanceData, material)));
+  for (int i = 0; i < 3; i++) {
+    size_t column = offset + offsetof(InstanceData, normal) + i * sizeof(vec3);
+    glVertexAttribPointer(m_normalMatrixAttribLocation + i, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void *)column);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
@@ -2,6 +2,7 @@
 
 #include "cs488-framework/ShaderProgram.hpp"
 #include "GeometryNode.hpp"
+#include "RenderQueue.hpp"
 #include <glm/gtc/type_ptr.hpp>
 
 class Project;
@@ -12,6 +13,12 @@ protected:
   GLuint m_normalAttribLocation;
   GLuint m_uvAttribLocation;
   GLuint m_tangentAttribLocation;
+  GLint m_modelAttribLocation;
+  GLint m_meshAttribLocation;
+
+  // Per-instance Model and meshIndex, common to all scene programs. Expects
+  // m_vao to be bound.
+  void enableInstanceSlots();
 public:
   GLuint m_vao;
   
@@ -19,30 +26,35 @@ public:
   virtual void enableVertexShaderInputSlots() {};
   virtual void setTextureMaps() {}
   virtual void mapVboDataToVertexShaderInputs(Project *project) {};
-  virtual void uploadCommonSceneUniforms(Project *project) {};
+  // Look up uniform locations once, after linking.
+  virtual void cacheUniformLocations() {}
+  // State shared by a run of instances, i.e. textures. The program must
+  // already be in use (Project::m_renderState).
   virtual void updateShaderUniforms(Project *project,
-    const GeometryNode *node,
-		const glm::mat4 & nodeTrans,
+    const RenderItem &item,
 		const glm::mat4 & viewMatrix) const = 0;
+  // Point the per-instance attributes at the InstanceData at `offset` bytes
+  // into Project::m_drawRing. Expects m_vao to be bound.
+  virtual void setInstanceOffset(Project *project, size_t offset) const;
 };
 
 class DepthMapShader : public SceneGraphShader {
   virtual void enableVertexShaderInputSlots();
   virtual void mapVboDataToVertexShaderInputs(Project *project);
-  virtual void uploadCommonSceneUniforms(Project *project);
   virtual void updateShaderUniforms(Project *project,
-    const GeometryNode *node,
-		const glm::mat4 & nodeTrans,
+    const RenderItem &item,
 		const glm::mat4 & viewMatrix) const;
 };
 
 class SceneShader : public SceneGraphShader {
+  GLint m_materialAttribLocation;
+  GLint m_normalMatrixAttribLocation;
+
   virtual void enableVertexShaderInputSlots();
   virtual void setTextureMaps();
   virtual void mapVboDataToVertexShaderInputs(Project *project);
-  virtual void uploadCommonSceneUniforms(Project *project);
   virtual void updateShaderUniforms(Project *project,
-    const GeometryNode *node,
-		const glm::mat4 & nodeTrans,
+    const RenderItem &item,
 		const glm::mat4 & viewMatrix) const;
+  virtual void setInstanceOffset(Project *project, size_t offset) const;
 };
@@ -0,0 +1,74 @@
+#include "SceneIndex.hpp"
+
+#include "GeometryNode.hpp"
+#include "JointNode.hpp"
+
+#include <unordered_set>
+
+using namespace std;
+
+//---------------------------------------------------------------------------------------
+void SceneIndex::clear() {
+	m_byName.clear();
+	m_nodes.clear();
+	m_geometryNodes.clear();
+	m_markers.clear();
+}
+
+//---------------------------------------------------------------------------------------
+void SceneIndex::build(SceneNode *root) {
+	clear();
+	if (!root) return;
+
+	// Walk iteratively; a node may be the child of several parents (e.g. the wall
+	// column shared by both walls), so remember what has been indexed.
+	unordered_set<SceneNode *> seen;
+	vector<SceneNode *> stack(1, root);
+	while (!stack.empty()) {
+		SceneNode *node = stack.back();
+		stack.pop_back();
+		if (!seen.insert(node).second) continue;
+
+		add(node);
+
+		// Push in reverse so children are visited in declaration order.
+		for (auto it = node->children.rbegin(); it != node->children.rend(); it++) {
+			stack.push_back(*it);
+		}
+	}
+}
+
+//---------------------------------------------------------------------------------------
+void SceneIndex::add(SceneNode *node) {
+	m_nodes.push_back(node);
+	if (node->m_nodeType == NodeType::GeometryNode) {
+		m_geometryNodes.push_back(static_cast<GeometryNode *>(node));
+	}
+
+	if (!node->m_name.empty() && node->m_name[0] == MARKER_PREFIX) {
+		m_markers.push_back(node);
+	}
+
+	// First node with a given name wins.
+	m_byName.emplace(node->m_name, node);
+}
+
+//---------------------------------------------------------------------------------------
+SceneNode * SceneIndex::findNode(const std::string & name) const {
+	auto it = m_byName.find(name);
+	return it == m_byName.end() ? nullptr : it->second;
+}
+
+//---------------------------------------------------------------------------------------
+GeometryNode * SceneIndex::findGeometry(const std::string & name) const {
+	SceneNode *node = findNode(name);
+	if (!node || node->m_nodeType != NodeType::GeometryNode) return nullptr;
+	return static_cast<GeometryNode *>(node);
+}
+
+//---------------------------------------------------------------------------------------
+JointNode * SceneIndex::findJoint(const std::string & name) const {
+	SceneNode *node = findNode(name);
+	if (!node || node->m_nodeType != NodeType::JointNode) return nullptr;
+	return static_cast<JointNode *>(node);
+}
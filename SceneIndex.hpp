@@ -0,0 +1,47 @@
+#pragma once
+
+#include "SceneNode.hpp"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class GeometryNode;
+class JointNode;
+
+// Name lookup for an imported scene graph. Built once while the scene is
+// imported so that callers can fetch named nodes directly instead of scanning
+// (and dynamic_casting) every node in the graph.
+//
+// The returned pointers are owned by the scene graph and stay valid until the
+// graph is destroyed.
+class SceneIndex {
+public:
+	// Names starting with this character mark nodes the application hooks into.
+	static const char MARKER_PREFIX = '~';
+
+	void clear();
+
+	// Index every node reachable from root. Nodes shared between several
+	// parents are only indexed once.
+	void build(SceneNode *root);
+
+	SceneNode * findNode(const std::string & name) const;
+	GeometryNode * findGeometry(const std::string & name) const;
+	JointNode * findJoint(const std::string & name) const;
+
+	// Every unique node, in traversal order.
+	const std::vector<SceneNode *> & nodes() const { return m_nodes; }
+	const std::vector<GeometryNode *> & geometryNodes() const { return m_geometryNodes; }
+
+	// Nodes whose names start with MARKER_PREFIX, in traversal order.
+	const std::vector<SceneNode *> & markers() const { return m_markers; }
+
+private:
+	void add(SceneNode *node);
+
+	std::unordered_map<std::string, SceneNode *> m_byName;
+	std::vector<SceneNode *> m_nodes;
+	std::vector<GeometryNode *> m_geometryNodes;
+	std::vector<SceneNode *> m_markers;
+};
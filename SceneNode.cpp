@@ -16,14 +16,18 @@ using namespace glm;
 // Static class variable
 unsigned int SceneNode::nodeInstanceCount = 0;
 
+const char * const HIDDEN_NODE_NAME = "~hidden";
+
 
 //---------------------------------------------------------------------------------------
 SceneNode::SceneNode(const std::string& name)
   : m_name(name),
 	m_nodeType(NodeType::SceneNode),
 	trans(mat4()),
-	isSelected(false),
-	m_nodeId(nodeInstanceCount++),position(0), moveVector(0), collisionRadius(1)
+	m_nodeId(nodeInstanceCount++),
+	m_layers(name == HIDDEN_NODE_NAME ? LAYER_HIDDEN : 0),
+	m_disabledLayers(0),
+	m_forcedLayers(0)
 {
 
 }
@@ -34,7 +38,10 @@ SceneNode::SceneNode(const SceneNode & other)
 	: m_nodeType(other.m_nodeType),
 	  m_name(other.m_name),
 	  trans(other.trans),
-	  invtrans(other.invtrans)
+	  invtrans(other.invtrans),
+	  m_layers(other.m_layers),
+	  m_disabledLayers(other.m_disabledLayers),
+	  m_forcedLayers(other.m_forcedLayers)
 {
 	for(SceneNode * child : other.children) {
 		this->children.push_front(new SceneNode(*child));
@@ -59,12 +66,29 @@ SceneNode::~SceneNode() {
 //---------------------------------------------------------------------------------------
 void SceneNode::set_transform(const glm::mat4& m) {
 	trans = m;
-	invtrans = m;
+	invtrans = glm::inverse(m);
 }
 
 
 const glm::mat4 SceneNode::get_transform() const {
-  return glm::translate(mat4(), position) * trans;
+  return trans;
+}
+
+//---------------------------------------------------------------------------------------
+void SceneNode::setLayer(unsigned int layer, bool enabled) {
+	if (enabled) {
+		m_disabledLayers &= ~layer;
+		m_forcedLayers |= layer;
+	} else {
+		m_disabledLayers |= layer;
+		m_forcedLayers &= ~layer;
+	}
+	updateLayers();
+}
+
+//---------------------------------------------------------------------------------------
+void SceneNode::updateLayers() {
+	m_layers = (m_layers & ~m_disabledLayers) | m_forcedLayers;
 }
 
 
@@ -102,12 +126,14 @@ void SceneNode::rotate(char axis, float angle) {
 	}
 	mat4 rot_matrix = glm::rotate(degreesToRadians(angle), rot_axis);
 	trans = rot_matrix * trans;
+	invtrans = invtrans * glm::rotate(-degreesToRadians(angle), rot_axis);
 }
 
 
 //---------------------------------------------------------------------------------------
 void SceneNode::translate(const glm::vec3& amount) {
 	trans = glm::translate(amount) * trans;
+	invtrans = invtrans * glm::translate(-amount);
 }
 
 
@@ -148,22 +174,7 @@ std::ostream & operator << (std::ostream & os, const SceneNode & node) {
 	return os;
 }
 
-void SceneNode::setMoveVector(const glm::vec3 &mv) {
-  moveVector = mv;
-}
-
-void SceneNode::move() {
-  position += moveVector;
-}
-
-void SceneNode::setPos(glm::vec3 pos) {
-  position = pos;
-}
-
-void SceneNode::scale(const glm::vec3 & amount) { // NOTE assumes we do scales first
+void SceneNode::scale(const glm::vec3 & amount) {
 	trans = glm::scale(amount) * trans;
-  if (amount.x == amount.y && amount.x == amount.z)
-    collisionRadius *= amount.x;
-  else
-    collisionRadius = 0;
+	invtrans = invtrans * glm::scale(1.0f / amount);
 }
@@ -11,6 +11,23 @@
 
 class GeometryNode;
 
+// Render layer bits. Each pass selects the nodes it draws by AND-ing its layer
+// against SceneNode::m_layers.
+enum RenderLayer : unsigned int {
+	LAYER_HIDDEN        = 1 << 0, // skip the node and its subtree
+	LAYER_SHADOW_CASTER = 1 << 1,
+	LAYER_OPAQUE        = 1 << 2,
+	LAYER_TRANSPARENT   = 1 << 3,
+	LAYER_UI            = 1 << 4, // drawn over the scene, after the transparent pass
+	LAYER_DYNAMIC       = 1 << 5  // moves often, kept out of the cached shadow map
+};
+
+// Layers a node passes on to its whole subtree.
+static const unsigned int INHERITED_LAYERS = LAYER_DYNAMIC;
+
+// Nodes with this name start out hidden.
+extern const char * const HIDDEN_NODE_NAME;
+
 enum class NodeType {
 	SceneNode,
 	GeometryNode,
@@ -37,6 +54,13 @@ public:
     
     void remove_child(SceneNode* child);
 
+    // Force a layer on or off. Forced layers stay on, and disabled layers
+    // off, when the derived layers are recomputed.
+    void setLayer(unsigned int layer, bool enabled);
+
+    // Recompute the layers derived from the node's state (e.g. its material).
+    virtual void updateLayers();
+
 	//-- Transformations:
     void rotate(char axis, float angle);
     void translate(const glm::vec3& amount);
@@ -44,8 +68,6 @@ public:
 
 	friend std::ostream & operator << (std::ostream & os, const SceneNode & node);
 
-	bool isSelected;
-    
     // Transformations
     glm::mat4 trans;
     glm::mat4 invtrans;
@@ -56,14 +78,11 @@ public:
 	std::string m_name;
 	unsigned int m_nodeId;
 
-void getNodes(std::vector<SceneNode *> &nodes);
+	unsigned int m_layers;         // RenderLayer bits
+	unsigned int m_disabledLayers; // set through setLayer(layer, false)
+	unsigned int m_forcedLayers;   // set through setLayer(layer, true)
 
-  void move();
-  void setMoveVector(const glm::vec3 &mv);
-  void setPos(glm::vec3 pos);
-  glm::vec3 position;
-  glm::vec3 moveVector;
-  float collisionRadius;
+void getNodes(std::vector<SceneNode *> &nodes);
 
 private:
 	// The number of SceneNode instances.
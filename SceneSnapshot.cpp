@@ -0,0 +1,314 @@
+#include "SceneSnapshot.hpp"
+
+#include "scene_lua.hpp"
+#include "GeometryNode.hpp"
+#include "JointNode.hpp"
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = {'S', 'C', 'N', '4', '8', '8', 0, 0};
+const uint32_t SNAPSHOT_VERSION = 4;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+const char * const SNAPSHOT_EXTENSION = ".snap";
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t numNodes;
+  uint32_t numChildren;
+  uint32_t stringBytes;
+  uint32_t reserved;
+  uint64_t inputHash;  // scene_script_hash of the script it was made from
+};
+
+struct SnapshotString {
+  uint32_t offset;
+  uint32_t length;
+};
+
+struct SnapshotNode {
+  uint32_t type;
+  uint32_t firstChild;
+  uint32_t numChildren;
+  uint32_t layers;
+  uint32_t disabledLayers;
+  uint32_t forcedLayers;
+  SnapshotString name;
+  SnapshotString meshId;
+  SnapshotString texture;
+  SnapshotString bumpMap;
+  float trans[16];
+  float kd[3];
+  float ks[3];
+  float shininess;
+  float transparency;
+  double jointX[3];
+  double jointY[3];
+};
+
+SnapshotString addString(vector<char> &strings, const string &s) {
+  SnapshotString ref;
+  ref.offset = strings.size();
+  ref.length = s.size();
+  strings.insert(strings.end(), s.begin(), s.end());
+  return ref;
+}
+
+bool validString(const SnapshotString &ref, uint32_t stringBytes) {
+  return ref.offset <= stringBytes && ref.length <= stringBytes - ref.offset;
+}
+
+string readString(const char *strings, const SnapshotString &ref) {
+  return string(strings + ref.offset, ref.length);
+}
+
+// 64-bit FNV-1a.
+uint64_t hashBytes(const char *data, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+}
+
+//---------------------------------------------------------------------------------------
+bool save_scene_snapshot(const SceneNode * root, const std::string & filename, uint64_t inputHash) {
+  if (!root) return false;
+
+  // The index gives every unique node once, root first.
+  SceneIndex index;
+  index.build(const_cast<SceneNode *>(root));
+  const vector<SceneNode *> &nodes = index.nodes();
+
+  unordered_map<const SceneNode *, uint32_t> nodeIds;
+  for (size_t i = 0; i < nodes.size(); i++) nodeIds[nodes[i]] = i;
+
+  vector<SnapshotNode> records(nodes.size());
+  vector<uint32_t> children;
+  vector<char> strings;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const SceneNode *node = nodes[i];
+    SnapshotNode &record = records[i];
+    memset(&record, 0, sizeof(record));
+
+    record.type = (uint32_t)node->m_nodeType;
+    record.name = addString(strings, node->m_name);
+    record.layers = node->m_layers;
+    record.disabledLayers = node->m_disabledLayers;
+    record.forcedLayers = node->m_forcedLayers;
+    memcpy(record.trans, glm::value_ptr(node->trans), sizeof(record.trans));
+
+    record.firstChild = children.size();
+    record.numChildren = node->children.size();
+    for (const SceneNode *child : node->children) {
+      children.push_back(nodeIds[child]);
+    }
+
+    if (node->m_nodeType == NodeType::GeometryNode) {
+      const GeometryNode *geometryNode = static_cast<const GeometryNode *>(node);
+      record.meshId = addString(strings, geometryNode->meshId);
+      record.texture = addString(strings, geometryNode->texture);
+      record.bumpMap = addString(strings, geometryNode->bumpMap);
+      const Material &material = geometryNode->material;
+      for (int c = 0; c < 3; c++) {
+        record.kd[c] = material.kd[c];
+        record.ks[c] = material.ks[c];
+      }
+      record.shininess = material.shininess;
+      record.transparency = material.transparency;
+    } else if (node->m_nodeType == NodeType::JointNode) {
+      const JointNode *jointNode = static_cast<const JointNode *>(node);
+      const JointNode::JointRange &x = jointNode->m_joint_x;
+      const JointNode::JointRange &y = jointNode->m_joint_y;
+      record.jointX[0] = x.min; record.jointX[1] = x.init; record.jointX[2] = x.max;
+      record.jointY[0] = y.min; record.jointY[1] = y.init; record.jointY[2] = y.max;
+    }
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byteOrder = SNAPSHOT_BYTE_ORDER;
+  header.numNodes = records.size();
+  header.numChildren = children.size();
+  header.stringBytes = strings.size();
+  header.inputHash = inputHash;
+
+  // Write next to the target and rename, so a crash never leaves a partial
+  // snapshot behind.
+  const string tmpFilename = filename + ".tmp";
+  FILE *f = fopen(tmpFilename.c_str(), "wb");
+  if (!f) return false;
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  ok = ok && fwrite(records.data(), sizeof(SnapshotNode), records.size(), f) == records.size();
+  ok = ok && fwrite(children.data(), sizeof(uint32_t), children.size(), f) == children.size();
+  ok = ok && fwrite(strings.data(), 1, strings.size(), f) == strings.size();
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    remove(tmpFilename.c_str());
+    return false;
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------------------
+SceneNode * load_scene_snapshot(const std::string & filename, SceneArena * arena,
+    const uint64_t * inputHash) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+    close(fd);
+    return nullptr;
+  }
+  size_t size = st.st_size;
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return nullptr;
+
+  const char *data = (const char *)mapped;
+  const SnapshotHeader *header = (const SnapshotHeader *)data;
+  const SnapshotNode *records = (const SnapshotNode *)(data + sizeof(SnapshotHeader));
+  const uint32_t *children = (const uint32_t *)(records + header->numNodes);
+  const char *strings = (const char *)(children + header->numChildren);
+
+  bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+    header->version == SNAPSHOT_VERSION &&
+    header->byteOrder == SNAPSHOT_BYTE_ORDER &&
+    (!inputHash || header->inputHash == *inputHash) &&
+    header->numNodes > 0 &&
+    size == sizeof(SnapshotHeader) + (size_t)header->numNodes * sizeof(SnapshotNode) +
+      (size_t)header->numChildren * sizeof(uint32_t) + header->stringBytes;
+  for (uint32_t i = 0; valid && i < header->numNodes; i++) {
+    const SnapshotNode &record = records[i];
+    valid = record.type <= (uint32_t)NodeType::JointNode &&
+      record.firstChild <= header->numChildren &&
+      record.numChildren <= header->numChildren - record.firstChild &&
+      validString(record.name, header->stringBytes) &&
+      validString(record.meshId, header->stringBytes) &&
+      validString(record.texture, header->stringBytes) &&
+      validString(record.bumpMap, header->stringBytes);
+  }
+  for (uint32_t i = 0; valid && i < header->numChildren; i++) {
+    valid = children[i] < header->numNodes;
+  }
+  if (!valid) {
+    munmap(mapped, size);
+    return nullptr;
+  }
+
+  vector<SceneNode *> nodes(header->numNodes);
+  for (uint32_t i = 0; i < header->numNodes; i++) {
+    const SnapshotNode &record = records[i];
+    const string name = readString(strings, record.name);
+    SceneNode *node;
+
+    switch ((NodeType)record.type) {
+      case NodeType::GeometryNode: {
+        const string meshId = readString(strings, record.meshId);
+        GeometryNode *geometryNode = arena ? arena->newGeometryNode(meshId, name) : new GeometryNode(meshId, name);
+        geometryNode->texture = readString(strings, record.texture);
+        geometryNode->bumpMap = readString(strings, record.bumpMap);
+        Material &material = geometryNode->material;
+        material.kd = glm::vec3(record.kd[0], record.kd[1], record.kd[2]);
+        material.ks = glm::vec3(record.ks[0], record.ks[1], record.ks[2]);
+        material.shininess = record.shininess;
+        material.transparency = record.transparency;
+        node = geometryNode;
+        break;
+      }
+      case NodeType::JointNode: {
+        JointNode *jointNode = arena ? arena->newJointNode(name) : new JointNode(name);
+        jointNode->set_joint_x(record.jointX[0], record.jointX[1], record.jointX[2]);
+        jointNode->set_joint_y(record.jointY[0], record.jointY[1], record.jointY[2]);
+        node = jointNode;
+        break;
+      }
+      default:
+        node = arena ? arena->newSceneNode(name) : new SceneNode(name);
+        break;
+    }
+    node->set_transform(glm::make_mat4(record.trans));
+    node->m_layers = record.layers;
+    node->m_disabledLayers = record.disabledLayers;
+    node->m_forcedLayers = record.forcedLayers;
+    nodes[i] = node;
+  }
+
+  for (uint32_t i = 0; i < header->numNodes; i++) {
+    const SnapshotNode &record = records[i];
+    for (uint32_t c = 0; c < record.numChildren; c++) {
+      nodes[i]->add_child(nodes[children[record.firstChild + c]]);
+    }
+  }
+
+  munmap(mapped, size);
+  return nodes[0];
+}
+
+//---------------------------------------------------------------------------------------
+std::string scene_snapshot_path(const std::string & luaFilename) {
+  return luaFilename + SNAPSHOT_EXTENSION;
+}
+
+//---------------------------------------------------------------------------------------
+bool scene_script_hash(const std::string & luaFilename, uint64_t & hash) {
+  FILE *f = fopen(luaFilename.c_str(), "rb");
+  if (!f) return false;
+  vector<char> contents;
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    contents.insert(contents.end(), buffer, buffer + n);
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+  if (ok) hash = hashBytes(contents.data(), contents.size());
+  return ok;
+}
+
+//---------------------------------------------------------------------------------------
+SceneNode * import_scene(const std::string & luaFilename, SceneIndex * index, SceneArena * arena) {
+  const string snapshotFilename = scene_snapshot_path(luaFilename);
+
+  // Without the script any readable snapshot will do.
+  uint64_t scriptHash = 0;
+  bool haveScript = scene_script_hash(luaFilename, scriptHash);
+
+  struct stat snapshot;
+  if (stat(snapshotFilename.c_str(), &snapshot) == 0) {
+    SceneNode *root = load_scene_snapshot(snapshotFilename, arena, haveScript ? &scriptHash : nullptr);
+    if (root) {
+      if (index) index->build(root);
+      return root;
+    }
+    cerr << "Ignoring stale or unreadable scene snapshot " << snapshotFilename << endl;
+  }
+
+  SceneNode *root = import_lua(luaFilename, index, arena);
+  if (root && !save_scene_snapshot(root, snapshotFilename, scriptHash)) {
+    cerr << "Could not write scene snapshot " << snapshotFilename << endl;
+  }
+  return root;
+}
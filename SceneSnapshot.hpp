@@ -0,0 +1,40 @@
+#pragma once
+
+#include "SceneNode.hpp"
+#include "SceneIndex.hpp"
+#include "SceneArena.hpp"
+
+#include <cstdint>
+#include <string>
+
+// Binary snapshots of an imported scene graph, so that start up does not have to
+// run the Lua scene script every time.
+//
+// A snapshot is one file: a header (format version and a hash of the scene
+// script), a fixed size record per unique node (type,
+// transform, render layers, material, texture names, joint ranges), a flat
+// child index array and a string table. It is memory mapped and read in place
+// when loading.
+
+// Write the graph under root to filename, tagged with the hash of the script
+// it came from. Returns false on failure.
+bool save_scene_snapshot(const SceneNode * root, const std::string & filename,
+    uint64_t inputHash = 0);
+
+// Rebuild a graph from a snapshot written by save_scene_snapshot. Returns null
+// if the file is missing, truncated, from another version or, when inputHash
+// is given, made from a different script. Nodes come from arena when given.
+SceneNode * load_scene_snapshot(const std::string & filename, SceneArena * arena = nullptr,
+    const uint64_t * inputHash = nullptr);
+
+// Snapshot file used for a given scene script.
+std::string scene_snapshot_path(const std::string & luaFilename);
+
+// Hash of the script contents, as stored in its snapshot. Returns false if
+// the script cannot be read.
+bool scene_script_hash(const std::string & luaFilename, uint64_t & hash);
+
+// Load the scene for luaFilename, from its snapshot if that was made from the
+// same script, otherwise through import_lua (refreshing the snapshot afterwards).
+SceneNode * import_scene(const std::string & luaFilename, SceneIndex * index = nullptr,
+    SceneArena * arena = nullptr);
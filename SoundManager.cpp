@@ -43,7 +43,11 @@ std::string printError(ALenum error) {
     return " Don't know ";
 }
 
-SoundManager::SoundManager(uint8_t numSources) {
+SoundManager::SoundManager(uint8_t numSources)
+  : m_device(nullptr),
+    m_context(nullptr),
+    m_buffers(nullptr)
+{
   m_soundBufferMap["bazinga.wav"] = 0;
   m_soundBufferMap["blop-q2.wav"] = 0;
   m_soundBufferMap["applause3.wav"] = 0;
@@ -57,8 +61,10 @@ SoundManager::SoundManager(uint8_t numSources) {
   m_bgSoundNameMap["background"] = "background.ogg";
 }
 
+// init() may never have run, e.g. in a headless run.
 SoundManager::~SoundManager() {
   delete[] m_buffers;
+  if (!m_context) return;
   auto device = alcGetContextsDevice(m_context);
   alcMakeContextCurrent(NULL);
   alcDestroyContext(m_context);
@@ -0,0 +1,74 @@
+#include "WorkerPool.hpp"
+
+using namespace std;
+
+WorkerPool::WorkerPool(size_t numThreads)
+  : m_job(nullptr), m_count(0), m_busyWorkers(0), m_generation(0), m_stop(false), m_next(0)
+{
+  if (numThreads == 0) numThreads = thread::hardware_concurrency();
+  for (size_t i = 1; i < numThreads; i++) {
+    m_threads.push_back(thread(&WorkerPool::workerLoop, this));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (thread &t : m_threads) t.join();
+}
+
+void WorkerPool::runJobs(const function<void(size_t)> &job, size_t count) {
+  for (size_t i = m_next++; i < count; i = m_next++) {
+    job(i);
+  }
+}
+
+void WorkerPool::parallelFor(size_t count, const function<void(size_t)> &job) {
+  if (count == 0) return;
+  if (m_threads.empty() || count == 1) {
+    for (size_t i = 0; i < count; i++) job(i);
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_job = &job;
+    m_count = count;
+    m_next = 0;
+    m_busyWorkers = m_threads.size();
+    m_generation++;
+  }
+  m_wake.notify_all();
+
+  runJobs(job, count);
+
+  unique_lock<mutex> lock(m_mutex);
+  m_done.wait(lock, [this] { return m_busyWorkers == 0; });
+  m_job = nullptr;
+}
+
+void WorkerPool::workerLoop() {
+  unsigned long seen = 0;
+  while (true) {
+    const function<void(size_t)> *job;
+    size_t count;
+    {
+      unique_lock<mutex> lock(m_mutex);
+      m_wake.wait(lock, [this, seen] { return m_stop || m_generation != seen; });
+      if (m_stop) return;
+      seen = m_generation;
+      job = m_job;
+      count = m_count;
+    }
+
+    runJobs(*job, count);
+
+    {
+      lock_guard<mutex> lock(m_mutex);
+      if (--m_busyWorkers == 0) m_done.notify_one();
+    }
+  }
+}
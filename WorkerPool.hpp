@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for splitting per-frame CPU work. The calling
+// thread takes part in every parallelFor, so a pool of size 1 runs inline.
+class WorkerPool {
+public:
+  // numThreads counts the calling thread; 0 picks one per hardware thread.
+  explicit WorkerPool(size_t numThreads = 0);
+  ~WorkerPool();
+
+  size_t size() const { return m_threads.size() + 1; }
+
+  // Run job(i) for every i in [0, count) and return once all have finished.
+  // Jobs may run on any thread and in any order.
+  void parallelFor(size_t count, const std::function<void(size_t)> &job);
+
+private:
+  void workerLoop();
+  void runJobs(const std::function<void(size_t)> &job, size_t count);
+
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  const std::function<void(size_t)> *m_job;
+  size_t m_count;
+  size_t m_busyWorkers;
+  unsigned long m_generation;
+  bool m_stop;
+
+  std::atomic<size_t> m_next;
+};
@@ -45,6 +45,7 @@ if os.get() == "linux" then
         "vorbisenc",
         "vorbisfile",
         "openal",
+        "EGL",
         "audio",
         "assimp"
     }
@@ -70,6 +70,30 @@
 // we can easily keep around the data, all we lose is the extra
 // pointers to it.
 
+// Arena of the import in progress, if any. Every node and material made by the
+// commands below comes from it.
+static SceneArena* importArena = 0;
+
+static SceneNode* newSceneNode(const char* name)
+{
+  return importArena ? importArena->newSceneNode(name) : new SceneNode(name);
+}
+
+static GeometryNode* newGeometryNode(const char* meshId, const char* name)
+{
+  return importArena ? importArena->newGeometryNode(meshId, name) : new GeometryNode(meshId, name);
+}
+
+static JointNode* newJointNode(const char* name)
+{
+  return importArena ? importArena->newJointNode(name) : new JointNode(name);
+}
+
+static Material* newMaterial()
+{
+  return importArena ? importArena->newMaterial() : new Material();
+}
+
 // The "userdata" type for a node. Objects of this type will be
 // allocated by Lua to represent nodes.
 struct gr_node_ud {
@@ -92,7 +116,7 @@ int gr_node_cmd(lua_State* L)
   data->node = 0;
 
   const char* name = luaL_checkstring(L, 1);
-  data->node = new SceneNode(name);
+  data->node = newSceneNode(name);
 
   luaL_getmetatable(L, "gr.node");
   lua_setmetatable(L, -2);
@@ -110,7 +134,7 @@ int gr_joint_cmd(lua_State* L)
   data->node = 0;
 
   const char* name = luaL_checkstring(L, 1);
-  JointNode* node = new JointNode(name);
+  JointNode* node = newJointNode(name);
 
   luaL_checktype(L, 2, LUA_TTABLE);
 
@@ -149,7 +173,7 @@ int gr_mesh_cmd(lua_State* L)
 
 	const char* meshId = luaL_checkstring(L, 1);
 	const char* name = luaL_checkstring(L, 2);
-	data->node = new GeometryNode(meshId, name);
+	data->node = newGeometryNode(meshId, name);
 
 	luaL_getmetatable(L, "gr.node");
 	lua_setmetatable(L, -2);
@@ -190,7 +214,7 @@ int gr_material_cmd(lua_State* L)
   }
   double shininess = luaL_checknumber(L, 3);
 
-	data->material = new Material();
+	data->material = newMaterial();
 	for(int i(0); i < 3; ++i) {
 		data->material->kd[i] = kd[i];
 		data->material->ks[i] = ks[i];
@@ -256,6 +280,32 @@ int gr_node_set_texture_cmd(lua_State *L) {
   return 0;
 }
 
+// Turn one of a node's render layers on or off, e.g.
+//   background:set_layer('shadow', false)
+extern "C"
+int gr_node_set_layer_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_node_ud* selfdata = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
+  luaL_argcheck(L, selfdata != 0, 1, "Node expected");
+
+  SceneNode* self = selfdata->node;
+
+  static const char* const layerNames[] = {
+    "hidden", "shadow", "opaque", "transparent", "ui", "dynamic", 0
+  };
+  static const unsigned int layers[] = {
+    LAYER_HIDDEN, LAYER_SHADOW_CASTER, LAYER_OPAQUE, LAYER_TRANSPARENT, LAYER_UI, LAYER_DYNAMIC
+  };
+  int layer = luaL_checkoption(L, 2, 0, layerNames);
+  bool enabled = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+
+  self->setLayer(layers[layer], enabled);
+
+  return 0;
+}
+
 // Set a node's material
 extern "C"
 int gr_node_set_material_cmd(lua_State* L)
@@ -277,6 +327,7 @@ int gr_node_set_material_cmd(lua_State* L)
 	self->material.ks = material->ks;
 	self->material.shininess = material->shininess;
 	self->material.transparency = material->transparency;
+	self->updateLayers();
 
   return 0;
 }
@@ -403,13 +454,20 @@ static const luaL_Reg grlib_node_methods[] = {
   {"rotate", gr_node_rotate_cmd},
   {"translate", gr_node_translate_cmd},
   {"set_texture", gr_node_set_texture_cmd},
+  {"set_layer", gr_node_set_layer_cmd},
   {0, 0}
 };
 
 // This function calls the lua interpreter to do the actual importing
-SceneNode* import_lua(const std::string& filename)
+SceneNode* import_lua(const std::string& filename, SceneIndex* index, SceneArena* arena)
 {
   GRLUA_DEBUG("Importing scene from " << filename);
+
+  // Route allocations to arena for the duration of the import
+  struct ArenaScope {
+    ArenaScope(SceneArena* arena) { importArena = arena; }
+    ~ArenaScope() { importArena = 0; }
+  } arenaScope(arena);
   
   // Start a lua interpreter
   lua_State* L = luaL_newstate();
@@ -460,6 +518,11 @@ SceneNode* import_lua(const std::string& filename)
   // Close the interpreter, free up any resources not needed
   lua_close(L);
 
+  if (index) {
+    GRLUA_DEBUG("Indexing the scene");
+    index->build(node);
+  }
+
   // And return the node
   return node;
 }
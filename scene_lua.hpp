@@ -2,6 +2,12 @@
 
 #include <string>
 #include "SceneNode.hpp"
+#include "SceneIndex.hpp"
+#include "SceneArena.hpp"
 
-SceneNode * import_lua(const std::string & filename);
+// Import a scene from a Lua file. If index is given it is rebuilt to cover the
+// imported graph. If arena is given it owns every node and material created,
+// otherwise they are allocated individually with new.
+SceneNode * import_lua(const std::string & filename, SceneIndex * index = nullptr,
+    SceneArena * arena = nullptr);
 